@@ -0,0 +1,110 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#include <string.h>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "bitmap.h"
+
+/** Clear @nwords words, then set the padding bits from @nbits on */
+void bitmap_init(uint64_t *map, int nwords, int nbits)
+{
+    int bit;
+
+    memset(map, 0, nwords * sizeof(*map));
+    for (bit = nbits; bit < nwords * 64; bit++)
+	bitmap_set(map, bit);
+}
+
+int bitmap_test(const uint64_t *map, int bit)
+{
+    return (map[bit / 64] >> (bit % 64)) & 1;
+}
+
+void bitmap_set(uint64_t *map, int bit)
+{
+    map[bit / 64] |= 1ULL << (bit % 64);
+}
+
+void bitmap_clear(uint64_t *map, int bit)
+{
+    map[bit / 64] &= ~(1ULL << (bit % 64));
+}
+
+/** Number of set bits below @nbits */
+int bitmap_weight(const uint64_t *map, int nbits)
+{
+    int w, n = 0;
+
+    for (w = 0; w < nbits / 64; w++)
+	n += __builtin_popcountll(map[w]);
+    if (nbits % 64)
+	n += __builtin_popcountll(map[w] & ((1ULL << (nbits % 64)) - 1));
+
+    return n;
+}
+
+/** Lowest clear bit at or after @start and below @nbits, or -1
+ *
+ * Works a word at a time: a word with no clear bits is skipped with
+ * one compare, and ctz finds the bit within the first word that has
+ * one.  With AVX2 fully used stretches are skipped 256 bits at a time.
+ */
+int bitmap_find_clear(const uint64_t *map, int nbits, int start)
+{
+    int nwords = BITMAP_WORDS(nbits);
+    int w = start / 64;
+    uint64_t word;
+    int bit;
+
+    if (start < 0 || start >= nbits)
+	return -1;
+
+    // ignore the bits below @start in the first word
+    word = ~map[w] & (~0ULL << (start % 64));
+    while (!word) {
+	w++;
+#ifdef __AVX2__
+	while (w + 4 <= nwords) {
+	    __m256i v = _mm256_loadu_si256((const __m256i *)(map + w));
+	    if (!_mm256_testc_si256(v, _mm256_set1_epi64x(-1)))
+		break;
+	    w += 4;
+	}
+#endif
+	if (w >= nwords)
+	    return -1;
+	word = ~map[w];
+    }
+
+    bit = w * 64 + __builtin_ctzll(word);
+    return bit < nbits ? bit : -1;
+}
+
+/** Find a clear bit, set it and return it, or return -1 when full
+ *
+ * Next fit: the search starts at *@cursor, where the previous one
+ * left off, and only wraps around to the start of the map when the
+ * tail is full, so a filling volume is not rescanned from bit 0 every
+ * time.
+ */
+int bitmap_alloc(uint64_t *map, int nbits, int *cursor)
+{
+    int bit = bitmap_find_clear(map, nbits, *cursor);
+
+    if (bit < 0 && *cursor > 0)
+	bit = bitmap_find_clear(map, *cursor, 0);
+    if (bit < 0)
+	return -1;
+
+    bitmap_set(map, bit);
+    *cursor = bit + 1 < nbits ? bit + 1 : 0;
+    return bit;
+}
@@ -0,0 +1,27 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _BITMAP_H_
+#define _BITMAP_H_
+
+#include <stdint.h>
+
+// Packed allocation bitmaps: one bit per object, set while it is in
+// use, stored as an array of 64-bit words.  Bits past the last object
+// are kept set so a search never hands them out.
+
+#define BITMAP_WORDS(nbits) (((nbits) + 63) / 64)
+
+void bitmap_init(uint64_t *map, int nwords, int nbits);
+int bitmap_test(const uint64_t *map, int bit);
+void bitmap_set(uint64_t *map, int bit);
+void bitmap_clear(uint64_t *map, int bit);
+int bitmap_weight(const uint64_t *map, int nbits);
+int bitmap_find_clear(const uint64_t *map, int nbits, int start);
+int bitmap_alloc(uint64_t *map, int nbits, int *cursor);
+
+#endif
@@ -5,63 +5,1218 @@
   See the file COPYING.
 */
 
+// for fallocate()
+#define _GNU_SOURCE
+
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <linux/falloc.h>
 
 #include "block.h"
+#include "uring.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+static int fd = -1;
+
+int block_size = BLOCK_SIZE_DEFAULT;
+
+/* block_lock covers the cache (pool, hash, LRU, stats); ring_lock the
+ * io_uring queues, only while queueing and reaping.  When both are
+ * needed block_lock comes first, and it comes before prefetch_lock too.
+ * Plain preadv/pwritev on fd need no lock, so file data I/O is done
+ * outside block_lock: callers keep two threads off the same data
+ * block at once (sfs.c holds the inode lock). */
+static pthread_mutex_t block_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int engine = BLOCK_ENGINE_SYNC;
+static struct uring *ring;
+
+/* One thread at a time waits in the kernel for completions, with
+ * ring_lock dropped; the others sleep on ring_cond.  Only the waiter
+ * reaps while there is one, so the completions it is waiting for
+ * cannot be taken from under it. */
+static pthread_cond_t ring_cond = PTHREAD_COND_INITIALIZER;
+static int ring_waiter;
+
+// what ring_run() queues for each run
+#define RING_READ  0
+#define RING_WRITE 1
+#define RING_PUNCH 2
+
+// how block_discard releases space, and whether the host can at all
+#define PUNCH_MODE (FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE)
+static int punch_failed;
+
+// submission queue depth of the io_uring engine
+#define URING_DEPTH 64
+
+/* Read-ahead is done by a background thread, so the reader that asks
+ * for it does not wait for it: block_prefetch queues the blocks and
+ * returns.  What does not fit in the queue is dropped; read-ahead is
+ * only a hint. */
+#define PREFETCH_QUEUE 256
+static pthread_t prefetch_thread;
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+static int prefetch_running;
+static int prefetch_queue[PREFETCH_QUEUE];
+static int prefetch_queued;
+static void prefetch_start(void);
+static void prefetch_stop(void);
+
+/* In mmap mode the first map_blocks blocks of the disk file are
+ * mapped shared at disk_map and all access to them is a memcpy; the
+ * mapping takes the place of the block cache. */
+static int map_request;
+static char *disk_map;
+static int map_blocks;
+
+static int mapped(const int block_num)
+{
+    return disk_map && block_num >= 0 && block_num < map_blocks;
+}
+
+static char *map_addr(const int block_num)
+{
+    return disk_map + (size_t)block_num * BLOCK_SIZE;
+}
+
+/** The block cache
+ *
+ * A fixed pool of BLOCK_SIZE buffers sized from the memory budget,
+ * looked up by block number through a chained hash table and kept on
+ * an LRU list (head is most recently used).  block_write only dirties
+ * the cached copy; dirty buffers reach the disk when they are evicted
+ * or on block_flush().
+ */
+struct cache_buf {
+    int block_num;
+    int dirty;
+    int prefetched;	// read ahead and not yet asked for
+    int stale;		// written or discarded while its prefetch was in flight
+    struct cache_buf *hnext;
+    struct cache_buf *prev;
+    struct cache_buf *next;
+    char *data;
+};
+
+static struct cache_buf *cache_pool;
+static char *cache_mem;
+static int cache_nbufs;
+static struct cache_buf **cache_hash;
+static int cache_nhash;
+static struct cache_buf *lru_head, *lru_tail;
+static int cache_inflight;	// buffers taken off the LRU by block_prefetch
+static struct cache_buf *inflight_head;	// ... linked through prev/next
+static unsigned long prefetch_landed;	// prefetches that have finished
+static size_t cache_budget = BLOCK_CACHE_DEFAULT;
+static struct block_stats stats;
+
+/** A run of adjacent blocks moved by one vectored call */
+struct block_run {
+    int block_num;
+    int nblocks;
+    struct iovec *iov;
+    int iovcnt;
+    int res;		// completion result, on the io_uring engine
+    int *done;		// its batch's count of completed runs
+};
+
+/* Length of the longest prefix of @block_nums that is adjacent on disk */
+static int run_length(const int *block_nums, int count)
+{
+    int n = 1;
+
+    while (n < count && block_nums[n] == block_nums[0] + n)
+	n++;
+
+    return n;
+}
+
+/* Transfer one run with preadv/pwritev, resuming after short
+ * transfers.  Reads past the end of the disk file come back as
+ * zeroes.  Returns the bytes moved or -1. */
+static ssize_t disk_run(int write, struct block_run *run)
+{
+    off_t pos = (off_t)run->block_num * BLOCK_SIZE;
+    size_t want = (size_t)run->nblocks * BLOCK_SIZE;
+    size_t done = 0;
+    struct iovec *iov = run->iov;
+    int iovcnt = run->iovcnt;
+
+    while (done < want) {
+	ssize_t n = write ? pwritev(fd, iov, iovcnt, pos + done)
+			  : preadv(fd, iov, iovcnt, pos + done);
+	if (n < 0) {
+	    perror(write ? "block_write failed" : "block_read failed");
+	    return -1;
+	}
+	if (n == 0) {
+	    if (write)
+		return -1;
+	    // past EOF: the rest of the run has never been written
+	    for (; iovcnt > 0; iov++, iovcnt--)
+		memset(iov->iov_base, 0, iov->iov_len);
+	    return done;
+	}
+	done += n;
+	while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+	    n -= iov->iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+	if (n > 0) {
+	    iov->iov_base = (char *)iov->iov_base + n;
+	    iov->iov_len -= n;
+	}
+    }
+
+    return done;
+}
+
+/* Hand every completion on the ring to the run it is for, which
+ * user_data points at.  The caller holds ring_lock. */
+static void ring_reap(void)
+{
+    unsigned long long ud;
+    int res, any = 0;
+
+    while (uring_reap(ring, &ud, &res) == 0) {
+	struct block_run *run = (struct block_run *)(uintptr_t)ud;
+	run->res = res;
+	(*run->done)++;
+	any = 1;
+    }
+    if (any)
+	pthread_cond_broadcast(&ring_cond);
+}
+
+/* Put @runs through the ring as one batch and wait until every one
+ * that went in has completed, so nothing on the ring still points at
+ * them.  Each run's result is left in its res; a run the kernel did
+ * not take gets -ECANCELED, for the caller to redo without the ring. */
+static void ring_run(int op, struct block_run *runs, int nruns)
+{
+    int queued = 0, done = 0, failed = 0;
+    int i;
+
+    for (i = 0; i < nruns; i++)
+	runs[i].done = &done;
+
+    pthread_mutex_lock(&ring_lock);
+    for (;;) {
+	int first = queued;
+
+	while (!failed && queued < nruns && uring_space(ring) > 0) {
+	    struct block_run *run = &runs[queued];
+	    off_t off = (off_t)run->block_num * BLOCK_SIZE;
+	    unsigned long long ud = (uintptr_t)run;
+	    if (op == RING_PUNCH)
+		uring_queue_fallocate(ring, fd, PUNCH_MODE, off,
+				      (off_t)run->nblocks * BLOCK_SIZE, ud);
+	    else
+		uring_queue_rw(ring, op == RING_WRITE, fd, run->iov,
+			       run->iovcnt, off, ud);
+	    queued++;
+	}
+	if (queued > first) {
+	    int ret = uring_submit(ring, 0);
+	    if (ret < queued - first) {
+		// take back what the kernel did not accept
+		if (ret < 0) {
+		    errno = -ret;
+		    perror("io_uring_enter failed");
+		}
+		queued -= uring_unqueue(ring);
+		failed = 1;
+	    }
+	}
+	if (!ring_waiter)
+	    ring_reap();
+	if (done == queued && (failed || queued == nruns))
+	    break;
+
+	if (ring_waiter) {
+	    pthread_cond_wait(&ring_cond, &ring_lock);
+	    continue;
+	}
+	ring_waiter = 1;
+	pthread_mutex_unlock(&ring_lock);
+	uring_wait(ring, 1);
+	pthread_mutex_lock(&ring_lock);
+	ring_waiter = 0;
+	ring_reap();
+	// someone else may have to take over the waiting
+	pthread_cond_broadcast(&ring_cond);
+    }
+    pthread_mutex_unlock(&ring_lock);
+
+    for (i = queued; i < nruns; i++)
+	runs[i].res = -ECANCELED;
+}
+
+/* Transfer a batch of runs.  The synchronous engine does them one
+ * after another; the io_uring engine puts them all on the ring, so
+ * independent runs are in flight together.  A short completion, or a
+ * run the ring did not take, is redone with disk_run().  Returns 0 or
+ * -1. */
+static int disk_submit(int write, struct block_run *runs, int nruns)
+{
+    int retstat = 0;
+    int i;
+
+    if (!ring) {
+	for (i = 0; i < nruns; i++)
+	    if (disk_run(write, &runs[i]) < 0)
+		retstat = -1;
+	return retstat;
+    }
+
+    ring_run(write ? RING_WRITE : RING_READ, runs, nruns);
+    for (i = 0; i < nruns; i++) {
+	struct block_run *run = &runs[i];
+	if (run->res == -ECANCELED ||
+	    (run->res >= 0 && (size_t)run->res < (size_t)run->nblocks * BLOCK_SIZE)) {
+	    if (disk_run(write, run) < 0)
+		retstat = -1;
+	} else if (run->res < 0) {
+	    errno = -run->res;
+	    perror(write ? "block_write failed" : "block_read failed");
+	    retstat = -1;
+	}
+    }
+
+    return retstat;
+}
+
+/* Punch one run out of the disk file.  Returns 0 or -1; once the host
+ * filesystem turns hole punching down it is not tried again. */
+static int punch_run(struct block_run *run)
+{
+    if (punch_failed)
+	return -1;
+    if (fallocate(fd, PUNCH_MODE, (off_t)run->block_num * BLOCK_SIZE,
+		  (off_t)run->nblocks * BLOCK_SIZE) < 0) {
+	if (errno == EOPNOTSUPP || errno == ENOSYS) {
+	    perror("hole punching unavailable, freed blocks keep their space");
+	    punch_failed = 1;
+	} else
+	    perror("block_discard failed");
+	return -1;
+    }
+
+    return 0;
+}
+
+/* disk_submit() for discards: one fallocate per run, all on the
+ * ring together with the io_uring engine.  A run the ring fails, as
+ * it does on kernels without IORING_OP_FALLOCATE, is redone with
+ * punch_run().  Returns 0 or -1. */
+static int disk_discard(struct block_run *runs, int nruns)
+{
+    int retstat = 0;
+    int i;
+
+    if (ring)
+	ring_run(RING_PUNCH, runs, nruns);
+    for (i = 0; i < nruns; i++)
+	if ((!ring || runs[i].res < 0) && punch_run(&runs[i]) < 0)
+	    retstat = -1;
+
+    return retstat;
+}
+
+static int disk_write(const int block_num, const void *buf)
+{
+    struct iovec iov = { (void *)buf, BLOCK_SIZE };
+    struct block_run run = {
+	.block_num = block_num, .nblocks = 1, .iov = &iov, .iovcnt = 1,
+    };
+
+    return disk_run(1, &run);
+}
+
+static void lru_unlink(struct cache_buf *cb)
+{
+    if (cb->prev)
+	cb->prev->next = cb->next;
+    else
+	lru_head = cb->next;
+    if (cb->next)
+	cb->next->prev = cb->prev;
+    else
+	lru_tail = cb->prev;
+    cb->prev = cb->next = NULL;
+}
+
+static void lru_push(struct cache_buf *cb)
+{
+    cb->prev = NULL;
+    cb->next = lru_head;
+    if (lru_head)
+	lru_head->prev = cb;
+    lru_head = cb;
+    if (!lru_tail)
+	lru_tail = cb;
+}
+
+static struct cache_buf **hash_slot(const int block_num)
+{
+    return &cache_hash[(unsigned)block_num & (cache_nhash - 1)];
+}
+
+/* A prefetched block was asked for: count the hit once */
+static void prefetch_hit(struct cache_buf *cb)
+{
+    if (cb->prefetched) {
+	cb->prefetched = 0;
+	stats.prefetch_hits++;
+    }
+}
+
+static void inflight_push(struct cache_buf *cb)
+{
+    cb->prev = NULL;
+    cb->next = inflight_head;
+    if (inflight_head)
+	inflight_head->prev = cb;
+    inflight_head = cb;
+}
+
+static void inflight_unlink(struct cache_buf *cb)
+{
+    if (cb->prev)
+	cb->prev->next = cb->next;
+    else
+	inflight_head = cb->next;
+    if (cb->next)
+	cb->next->prev = cb->prev;
+    cb->prev = cb->next = NULL;
+}
+
+/* @block_nums are changing on the disk: a prefetch of any of them
+ * still in flight may read the old contents, so it must not cache
+ * them, and one still queued is dropped before it starts.  The caller
+ * holds block_lock. */
+static void prefetch_invalidate(const int *block_nums, int count)
+{
+    struct cache_buf *cb;
+    int i, j, k;
+
+    for (cb = inflight_head; cb; cb = cb->next)
+	for (i = 0; i < count; i++)
+	    if (cb->block_num == block_nums[i])
+		cb->stale = 1;
+
+    pthread_mutex_lock(&prefetch_lock);
+    for (j = k = 0; j < prefetch_queued; j++) {
+	for (i = 0; i < count; i++)
+	    if (prefetch_queue[j] == block_nums[i])
+		break;
+	if (i == count)
+	    prefetch_queue[k++] = prefetch_queue[j];
+    }
+    prefetch_queued = k;
+    pthread_mutex_unlock(&prefetch_lock);
+}
+
+static struct cache_buf *cache_lookup(const int block_num)
+{
+    struct cache_buf *cb;
+
+    for (cb = *hash_slot(block_num); cb; cb = cb->hnext)
+	if (cb->block_num == block_num) {
+	    lru_unlink(cb);
+	    lru_push(cb);
+	    return cb;
+	}
+
+    return NULL;
+}
+
+static void hash_remove(struct cache_buf *cb)
+{
+    struct cache_buf **pp;
+
+    for (pp = hash_slot(cb->block_num); *pp; pp = &(*pp)->hnext)
+	if (*pp == cb) {
+	    *pp = cb->hnext;
+	    break;
+	}
+    cb->hnext = NULL;
+}
+
+static void lru_push_tail(struct cache_buf *cb)
+{
+    cb->next = NULL;
+    cb->prev = lru_tail;
+    if (lru_tail)
+	lru_tail->next = cb;
+    lru_tail = cb;
+    if (!lru_head)
+	lru_head = cb;
+}
+
+/* Take the least recently used buffer, writing it back first if it
+ * is dirty, and rebind it to @block_num. */
+static struct cache_buf *cache_alloc(const int block_num)
+{
+    struct cache_buf *cb = lru_tail;
+
+    if (!cb)
+	return NULL;
+    if (cb->block_num >= 0) {
+	if (cb->dirty && disk_write(cb->block_num, cb->data) < 0)
+	    return NULL;
+	if (cb->prefetched)
+	    stats.prefetch_wasted++;
+	hash_remove(cb);
+    }
+    cb->block_num = block_num;
+    cb->dirty = 0;
+    cb->prefetched = 0;
+    cb->hnext = *hash_slot(block_num);
+    *hash_slot(block_num) = cb;
+    lru_unlink(cb);
+    lru_push(cb);
+
+    return cb;
+}
+
+static void cache_free(void)
+{
+    int i;
+
+    for (i = 0; i < cache_nbufs; i++)
+	if (cache_pool[i].block_num >= 0 && cache_pool[i].prefetched)
+	    stats.prefetch_wasted++;
+    free(cache_pool);
+    free(cache_mem);
+    free(cache_hash);
+    cache_pool = NULL;
+    cache_mem = NULL;
+    cache_hash = NULL;
+    cache_nbufs = 0;
+    cache_inflight = 0;
+    inflight_head = NULL;
+    lru_head = lru_tail = NULL;
+}
+
+static void cache_setup(void)
+{
+    int i;
+
+    cache_nbufs = cache_budget / BLOCK_SIZE;
+    if (cache_nbufs == 0)
+	return;
+    for (cache_nhash = 1; cache_nhash < cache_nbufs; cache_nhash <<= 1)
+	;
+    cache_pool = calloc(cache_nbufs, sizeof(struct cache_buf));
+    cache_mem = malloc((size_t)cache_nbufs * BLOCK_SIZE);
+    cache_hash = calloc(cache_nhash, sizeof(struct cache_buf *));
+    if (!cache_pool || !cache_mem || !cache_hash) {
+	perror("block cache disabled");
+	cache_free();
+	return;
+    }
+    for (i = 0; i < cache_nbufs; i++) {
+	cache_pool[i].block_num = -1;
+	cache_pool[i].data = cache_mem + (size_t)i * BLOCK_SIZE;
+	lru_push(&cache_pool[i]);
+    }
+}
+
+/** Set the block size of the disk
+ *
+ * Must be called before disk_open().  The size has to be a power of
+ * two between BLOCK_SIZE_MIN and BLOCK_SIZE_MAX; returns -1 and
+ * leaves the size alone otherwise.
+ */
+int block_set_size(int size)
+{
+    if (size < BLOCK_SIZE_MIN || size > BLOCK_SIZE_MAX || (size & (size - 1)))
+	return -1;
+    block_size = size;
+
+    return 0;
+}
+
+/** Choose the I/O engine, BLOCK_ENGINE_SYNC or BLOCK_ENGINE_URING
+ *
+ * Must be called before disk_open().  If io_uring cannot be set up
+ * the disk is opened with the synchronous engine instead.
+ */
+void block_set_engine(int e)
+{
+    engine = e;
+}
+
+/** The engine actually in use on the open disk */
+int block_engine(void)
+{
+    return ring ? BLOCK_ENGINE_URING : BLOCK_ENGINE_SYNC;
+}
+
+/** Map the first @nblocks blocks of the disk instead of caching
+ *
+ * Must be called before disk_open(), which grows the disk file to
+ * @nblocks blocks if needed.  Blocks past the mapping still go
+ * through the engine.  Zero turns mmap mode off.
+ */
+void block_set_mmap(int nblocks)
+{
+    map_request = nblocks;
+}
+
+/** Address of a mapped block, or NULL when it is not mapped
+ *
+ * Lets callers in mmap mode inspect a block in place instead of
+ * copying it out with block_read.  The pointer is only good until
+ * disk_close().
+ */
+const void *block_ptr(const int block_num)
+{
+    return mapped(block_num) ? map_addr(block_num) : NULL;
+}
+
+static void map_setup(void)
+{
+    struct stat st;
+    size_t len = (size_t)map_request * BLOCK_SIZE;
+
+    if (fstat(fd, &st) < 0 ||
+	((size_t)st.st_size < len && ftruncate(fd, len) < 0)) {
+	perror("disk mmap disabled");
+	return;
+    }
+    disk_map = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (disk_map == MAP_FAILED) {
+	perror("disk mmap disabled");
+	disk_map = NULL;
+	return;
+    }
+    map_blocks = map_request;
+}
+
+/** Set the memory budget of the block cache, in bytes
+ *
+ * Must be called before disk_open().  A budget smaller than one
+ * block disables caching and every access goes to the disk.
+ */
+void block_cache_init(size_t budget)
+{
+    cache_budget = budget;
+}
 
 void disk_open(const char* diskfile_path)
 {
     if(fd >= 0){
 	return;
     }
-    
+
     fd = open(diskfile_path, O_CREAT|O_RDWR, S_IRUSR|S_IWUSR);
     if (fd < 0) {
 	perror("disk_open failed");
 	exit(EXIT_FAILURE);
     }
+    if (engine == BLOCK_ENGINE_URING && !(ring = uring_open(URING_DEPTH)))
+	perror("io_uring unavailable, using pread/pwrite");
+    if (map_request > 0)
+	map_setup();
+    if (!disk_map)
+	cache_setup();
+    if (cache_nbufs > 0)
+	prefetch_start();
 }
 
 void disk_close()
 {
     if(fd >= 0){
+	prefetch_stop();
+	block_flush();
+	cache_free();
+	if (disk_map) {
+	    msync(disk_map, (size_t)map_blocks * BLOCK_SIZE, MS_SYNC);
+	    munmap(disk_map, (size_t)map_blocks * BLOCK_SIZE);
+	    disk_map = NULL;
+	    map_blocks = 0;
+	}
+	uring_close(ring);
+	ring = NULL;
 	close(fd);
+	fd = -1;
     }
 }
 
+/* Cached copy of @block_num without touching the LRU order, or NULL */
+static struct cache_buf *cache_peek(const int block_num)
+{
+    struct cache_buf *cb;
+
+    if (cache_nbufs == 0)
+	return NULL;
+    for (cb = *hash_slot(block_num); cb; cb = cb->hnext)
+	if (cb->block_num == block_num)
+	    return cb;
+
+    return NULL;
+}
+
 /** Read a block from an open file
  *
- * Read should return (1) exactly @BLOCK_SIZE when succeeded, or (2) 0 when the requested block has never been touched before, or (3) a negtive value when failed. 
+ * Read should return (1) exactly @BLOCK_SIZE when succeeded, or (2) 0 when the requested block has never been touched before, or (3) a negtive value when failed.
  * In cases of error or return value equals to 0, the content of the @buf is set to 0.
  */
 int block_read(const int block_num, void *buf)
 {
     int retstat = 0;
-    retstat = pread(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+    struct cache_buf *cb = NULL;
+
+    if (mapped(block_num)) {
+	memcpy(buf, map_addr(block_num), BLOCK_SIZE);
+	return BLOCK_SIZE;
+    }
+
+    // a miss is read under the lock, so that a dirty copy cannot be
+    // written back and dropped while we fetch the older one
+    pthread_mutex_lock(&block_lock);
+    if (cache_nbufs > 0) {
+	cb = cache_lookup(block_num);
+	if (cb) {
+	    prefetch_hit(cb);
+	    memcpy(buf, cb->data, BLOCK_SIZE);
+	    pthread_mutex_unlock(&block_lock);
+	    return BLOCK_SIZE;
+	}
+    }
+
+    retstat = pread(fd, buf, BLOCK_SIZE, (off_t)block_num*BLOCK_SIZE);
     if (retstat <= 0){
 	memset(buf, 0, BLOCK_SIZE);
 	if(retstat<0)
 	perror("block_read failed");
     }
 
+    if (retstat >= 0 && cache_nbufs > 0 && (cb = cache_alloc(block_num)))
+	memcpy(cb->data, buf, BLOCK_SIZE);
+    pthread_mutex_unlock(&block_lock);
+
     return retstat;
 }
 
 /** Write a block to an open file
  *
- * Write should return exactly @BLOCK_SIZE except on error. 
+ * Write should return exactly @BLOCK_SIZE except on error.
+ * With the cache enabled the block is only dirtied in memory; it is
+ * written to the disk on eviction or block_flush().
  */
 int block_write(const int block_num, const void *buf)
+{
+    struct cache_buf *cb;
+
+    if (mapped(block_num)) {
+	memcpy(map_addr(block_num), buf, BLOCK_SIZE);
+	return BLOCK_SIZE;
+    }
+
+    if (cache_nbufs == 0)
+	return disk_write(block_num, buf);
+
+    pthread_mutex_lock(&block_lock);
+    cb = cache_lookup(block_num);
+    if (!cb && !(cb = cache_alloc(block_num))) {
+	pthread_mutex_unlock(&block_lock);
+	return -1;
+    }
+    if (cb->prefetched)
+	stats.prefetch_wasted++;
+    cb->prefetched = 0;
+    memcpy(cb->data, buf, BLOCK_SIZE);
+    cb->dirty = 1;
+    pthread_mutex_unlock(&block_lock);
+
+    return BLOCK_SIZE;
+}
+
+/** Read @count blocks into consecutive BLOCK_SIZE slots of @buf
+ *
+ * Cached blocks are copied from memory.  The remaining blocks are
+ * grouped into runs that are adjacent on disk, and each run costs a
+ * single preadv.  All runs are handed to the engine as one batch,
+ * without holding the cache lock.  File data is not inserted into
+ * the cache.  Returns the number of blocks read, or a negative value
+ * on error.
+ */
+int block_readv(const int *block_nums, int count, void *buf)
+{
+    char *p = buf;
+    int i, n;
+    int nruns = 0;
+    int retstat = count;
+    struct block_run *runs = malloc(count * sizeof(*runs));
+    struct iovec *iov = malloc(count * sizeof(*iov));
+
+    if (count > 0 && (!runs || !iov)) {
+	free(runs);
+	free(iov);
+	return -1;
+    }
+
+    pthread_mutex_lock(&block_lock);
+    for (i = 0; i < count; i += n) {
+	struct cache_buf *cb = NULL;
+
+	if (mapped(block_nums[i]))
+	    memcpy(p + (size_t)i * BLOCK_SIZE, map_addr(block_nums[i]), BLOCK_SIZE);
+	else
+	    cb = cache_peek(block_nums[i]);
+	if (cb) {
+	    prefetch_hit(cb);
+	    memcpy(p + (size_t)i * BLOCK_SIZE, cb->data, BLOCK_SIZE);
+	}
+	if (cb || mapped(block_nums[i])) {
+	    n = 1;
+	    continue;
+	}
+
+	// extend the run while the blocks are adjacent and not cached
+	for (n = 1; i + n < count && block_nums[i+n] == block_nums[i] + n &&
+		 !mapped(block_nums[i+n]) && !cache_peek(block_nums[i+n]); n++)
+	    ;
+	iov[nruns].iov_base = p + (size_t)i * BLOCK_SIZE;
+	iov[nruns].iov_len = (size_t)n * BLOCK_SIZE;
+	runs[nruns].block_num = block_nums[i];
+	runs[nruns].nblocks = n;
+	runs[nruns].iov = &iov[nruns];
+	runs[nruns].iovcnt = 1;
+	nruns++;
+    }
+    pthread_mutex_unlock(&block_lock);
+
+    if (disk_submit(0, runs, nruns) < 0) {
+	memset(buf, 0, (size_t)count * BLOCK_SIZE);
+	retstat = -1;
+    }
+
+    free(runs);
+    free(iov);
+    return retstat;
+}
+
+/** Write @count blocks from consecutive BLOCK_SIZE slots of @buf
+ *
+ * Runs of blocks that are adjacent on disk go out in a single
+ * pwritev, straight through to the disk, and all runs are submitted
+ * as one batch.  Any cached copies are refreshed and left clean
+ * first, so an eviction cannot write older data over the new.
+ * Returns the number of blocks written, or a negative value on error.
+ */
+int block_writev(const int *block_nums, int count, const void *buf)
+{
+    const char *p = buf;
+    int i, j, n;
+    int nruns = 0;
+    int retstat = count;
+    struct block_run *runs = malloc(count * sizeof(*runs));
+    struct iovec *iov = malloc(count * sizeof(*iov));
+
+    if (count > 0 && (!runs || !iov)) {
+	free(runs);
+	free(iov);
+	return -1;
+    }
+
+    for (i = 0; i < count; i += n) {
+	n = run_length(block_nums + i, count - i);
+	if (mapped(block_nums[i])) {
+	    n = 1;
+	    memcpy(map_addr(block_nums[i]), p + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+	    continue;
+	}
+	iov[nruns].iov_base = (void *)(p + (size_t)i * BLOCK_SIZE);
+	iov[nruns].iov_len = (size_t)n * BLOCK_SIZE;
+	runs[nruns].block_num = block_nums[i];
+	runs[nruns].nblocks = n;
+	runs[nruns].iov = &iov[nruns];
+	runs[nruns].iovcnt = 1;
+	nruns++;
+    }
+
+    pthread_mutex_lock(&block_lock);
+    for (j = 0; j < count; j++) {
+	struct cache_buf *cb = cache_peek(block_nums[j]);
+	if (cb) {
+	    if (cb->prefetched)
+		stats.prefetch_wasted++;
+	    cb->prefetched = 0;
+	    memcpy(cb->data, p + (size_t)j * BLOCK_SIZE, BLOCK_SIZE);
+	    cb->dirty = 0;
+	}
+    }
+    prefetch_invalidate(block_nums, count);
+    unsigned long landed = prefetch_landed;
+    pthread_mutex_unlock(&block_lock);
+
+    int failed = disk_submit(1, runs, nruns) < 0;
+
+    // a prefetch that started reading after the check above may have
+    // got the old contents; mark it, or refresh what it cached
+    pthread_mutex_lock(&block_lock);
+    if (cache_inflight > 0 || landed != prefetch_landed) {
+	prefetch_invalidate(block_nums, count);
+	for (j = 0; j < count; j++) {
+	    struct cache_buf *cb = cache_peek(block_nums[j]);
+	    if (cb && cb->prefetched)
+		memcpy(cb->data, p + (size_t)j * BLOCK_SIZE, BLOCK_SIZE);
+	}
+    }
+    pthread_mutex_unlock(&block_lock);
+
+    if (failed) {
+	retstat = -1;
+	// keep whatever is cached so a later flush can retry
+	pthread_mutex_lock(&block_lock);
+	for (j = 0; j < count; j++) {
+	    struct cache_buf *cb = cache_peek(block_nums[j]);
+	    if (cb)
+		cb->dirty = 1;
+	}
+	pthread_mutex_unlock(&block_lock);
+    }
+
+    free(runs);
+    free(iov);
+    return retstat;
+}
+
+/** Give the space of @count blocks back to the host filesystem
+ *
+ * Cached copies are dropped, dirty or not, and each run of blocks
+ * that are adjacent on disk is punched out of the disk file with one
+ * fallocate, all runs as one batch.  Nothing is written.  The blocks
+ * read back as zeroes afterwards, or keep their old contents where
+ * the host cannot punch holes.  Callers keep everyone else off the
+ * blocks meanwhile (sfs.c holds alloc_lock).  Returns 0, or -1 when
+ * the space could not be released.
+ */
+int block_discard(const int *block_nums, int count)
+{
+    struct block_run *runs;
+    int i, n, nruns = 0;
+    int retstat;
+
+    if (count <= 0)
+	return 0;
+    runs = malloc(count * sizeof(*runs));
+    if (!runs)
+	return -1;
+
+    pthread_mutex_lock(&block_lock);
+    for (i = 0; i < count; i++) {
+	struct cache_buf *cb = cache_peek(block_nums[i]);
+	if (!cb)
+	    continue;
+	if (cb->prefetched)
+	    stats.prefetch_wasted++;
+	hash_remove(cb);
+	cb->block_num = -1;
+	cb->dirty = 0;
+	cb->prefetched = 0;
+	lru_unlink(cb);
+	lru_push_tail(cb);
+    }
+    prefetch_invalidate(block_nums, count);
+    pthread_mutex_unlock(&block_lock);
+
+    for (i = 0; i < count; i += n) {
+	n = run_length(block_nums + i, count - i);
+	runs[nruns].block_num = block_nums[i];
+	runs[nruns].nblocks = n;
+	runs[nruns].iov = NULL;
+	runs[nruns].iovcnt = 0;
+	nruns++;
+    }
+    retstat = disk_discard(runs, nruns);
+
+    free(runs);
+    return retstat;
+}
+
+/* Read blocks into the cache ahead of their use, on the calling
+ * thread.  Blocks that are already cached are skipped; the rest are
+ * read in one batch, a run per group of adjacent blocks, and marked
+ * as prefetched until block_read/block_readv asks for them.  The
+ * buffers are off the LRU and out of the hash while the read is in
+ * flight, so the cache lock is not held across it; a block written or
+ * discarded meanwhile is dropped rather than cached.  At most a
+ * quarter of the cache is in flight at once so read-ahead cannot
+ * flush the metadata out.  Returns the number of blocks read. */
+static int prefetch_read(const int *block_nums, int count)
+{
+    struct cache_buf **bufs;
+    struct block_run *runs;
+    struct iovec *iov;
+    int nbufs = 0, nruns = 0;
+    int i;
+
+    bufs = malloc(count * sizeof(*bufs));
+    runs = malloc(count * sizeof(*runs));
+    iov = malloc(count * sizeof(*iov));
+    if (!bufs || !runs || !iov)
+	goto out;
+
+    pthread_mutex_lock(&block_lock);
+    for (i = 0; i < count && cache_inflight < cache_nbufs / 4; i++) {
+	struct cache_buf *cb;
+	if (cache_peek(block_nums[i]) || !(cb = cache_alloc(block_nums[i])))
+	    continue;
+	hash_remove(cb);
+	lru_unlink(cb);
+	inflight_push(cb);
+	cb->stale = 0;
+	cache_inflight++;
+	iov[nbufs].iov_base = cb->data;
+	iov[nbufs].iov_len = BLOCK_SIZE;
+	if (nruns > 0 && nbufs > 0 && bufs[nbufs-1]->block_num + 1 == cb->block_num &&
+	    runs[nruns-1].iovcnt < IOV_MAX) {
+	    runs[nruns-1].nblocks++;
+	    runs[nruns-1].iovcnt++;
+	} else {
+	    runs[nruns].block_num = cb->block_num;
+	    runs[nruns].nblocks = 1;
+	    runs[nruns].iov = &iov[nbufs];
+	    runs[nruns].iovcnt = 1;
+	    nruns++;
+	}
+	bufs[nbufs++] = cb;
+    }
+    pthread_mutex_unlock(&block_lock);
+
+    int failed = disk_submit(0, runs, nruns) < 0;
+
+    pthread_mutex_lock(&block_lock);
+    for (i = 0; i < nbufs; i++) {
+	struct cache_buf *cb = bufs[i];
+	inflight_unlink(cb);
+	cache_inflight--;
+	// drop it if the read failed, the block changed on the disk
+	// under it, or someone cached the block meanwhile
+	if (failed || cb->stale || cache_peek(cb->block_num)) {
+	    cb->block_num = -1;
+	    lru_push_tail(cb);
+	    continue;
+	}
+	cb->prefetched = 1;
+	cb->hnext = *hash_slot(cb->block_num);
+	*hash_slot(cb->block_num) = cb;
+	lru_push(cb);
+	stats.prefetched++;
+    }
+    prefetch_landed++;
+    pthread_mutex_unlock(&block_lock);
+    if (failed)
+	nbufs = 0;
+
+out:
+    free(bufs);
+    free(runs);
+    free(iov);
+    return nbufs;
+}
+
+static void *prefetch_main(void *arg)
+{
+    int nums[PREFETCH_QUEUE];
+    int n;
+
+    (void)arg;
+    pthread_mutex_lock(&prefetch_lock);
+    while (prefetch_running) {
+	if (prefetch_queued == 0) {
+	    pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+	    continue;
+	}
+	n = prefetch_queued;
+	memcpy(nums, prefetch_queue, n * sizeof(int));
+	prefetch_queued = 0;
+	pthread_mutex_unlock(&prefetch_lock);
+	prefetch_read(nums, n);
+	pthread_mutex_lock(&prefetch_lock);
+    }
+    pthread_mutex_unlock(&prefetch_lock);
+    return NULL;
+}
+
+static void prefetch_start(void)
+{
+    prefetch_running = 1;
+    prefetch_queued = 0;
+    if (pthread_create(&prefetch_thread, NULL, prefetch_main, NULL) != 0) {
+	perror("read-ahead thread not started, prefetching inline");
+	prefetch_running = 0;
+    }
+}
+
+// stop the read-ahead thread after its current batch, dropping the rest
+static void prefetch_stop(void)
+{
+    pthread_mutex_lock(&prefetch_lock);
+    int running = prefetch_running;
+    prefetch_running = 0;
+    prefetch_queued = 0;
+    pthread_cond_signal(&prefetch_cond);
+    pthread_mutex_unlock(&prefetch_lock);
+    if (running)
+	pthread_join(prefetch_thread, NULL);
+}
+
+/** Start reading blocks into the cache ahead of their use
+ *
+ * The blocks are queued for the read-ahead thread, which reads them
+ * in one batch and caches them marked as prefetched until
+ * block_read/block_readv asks for them; the caller does not wait for
+ * the disk.  If the thread could not be started they are read here
+ * instead.  In mmap mode the kernel is told to page the blocks in.
+ * Returns the number of blocks queued or read.
+ */
+int block_prefetch(const int *block_nums, int count)
+{
+    int i, n;
+
+    if (disk_map) {
+	for (i = 0; i < count; i++)
+	    if (mapped(block_nums[i]))
+		madvise(map_addr(block_nums[i]), BLOCK_SIZE, MADV_WILLNEED);
+	return 0;
+    }
+    if (count <= 0 || cache_nbufs == 0)
+	return 0;
+
+    pthread_mutex_lock(&prefetch_lock);
+    if (!prefetch_running) {
+	pthread_mutex_unlock(&prefetch_lock);
+	return prefetch_read(block_nums, count);
+    }
+    n = PREFETCH_QUEUE - prefetch_queued < count ? PREFETCH_QUEUE - prefetch_queued : count;
+    memcpy(prefetch_queue + prefetch_queued, block_nums, n * sizeof(int));
+    prefetch_queued += n;
+    if (n > 0)
+	pthread_cond_signal(&prefetch_cond);
+    pthread_mutex_unlock(&prefetch_lock);
+
+    return n;
+}
+
+/** Counters kept by the block layer since the program started */
+void block_get_stats(struct block_stats *st)
+{
+    pthread_mutex_lock(&block_lock);
+    *st = stats;
+    pthread_mutex_unlock(&block_lock);
+}
+
+static int cmp_buf(const void *a, const void *b)
+{
+    const struct cache_buf *x = *(struct cache_buf * const *)a;
+    const struct cache_buf *y = *(struct cache_buf * const *)b;
+
+    return (x->block_num > y->block_num) - (x->block_num < y->block_num);
+}
+
+/** Write every dirty cached block back to the disk
+ *
+ * Returns 0, or a negative value if any write failed; blocks that
+ * could not be written stay dirty.
+ */
+int block_flush(void)
 {
     int retstat = 0;
-    retstat = pwrite(fd, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
-    if (retstat < 0)
-	perror("block_write failed");
-    
+    int ndirty = 0;
+    int nruns = 0;
+    int i, j, k;
+    struct cache_buf **dirty;
+    struct iovec *iov;
+    struct block_run *runs;
+
+    if (cache_nbufs == 0)
+	return 0;
+    dirty = malloc(cache_nbufs * sizeof(*dirty));
+    iov = malloc(cache_nbufs * sizeof(*iov));
+    runs = malloc(cache_nbufs * sizeof(*runs));
+    if (!dirty || !iov || !runs) {
+	free(dirty);
+	free(iov);
+	free(runs);
+	return -1;
+    }
+
+    // held across the writes so no buffer is rebound under us
+    pthread_mutex_lock(&block_lock);
+    for (i = 0; i < cache_nbufs; i++)
+	if (cache_pool[i].block_num >= 0 && cache_pool[i].dirty)
+	    dirty[ndirty++] = &cache_pool[i];
+    qsort(dirty, ndirty, sizeof(*dirty), cmp_buf);
+
+    // one pwritev per run of adjacent dirty blocks, all in one batch
+    for (i = 0; i < ndirty; i = j) {
+	for (j = i + 1; j < ndirty && j - i < IOV_MAX &&
+		 dirty[j]->block_num == dirty[j-1]->block_num + 1; j++)
+	    ;
+	for (k = i; k < j; k++) {
+	    iov[k].iov_base = dirty[k]->data;
+	    iov[k].iov_len = BLOCK_SIZE;
+	}
+	runs[nruns].block_num = dirty[i]->block_num;
+	runs[nruns].nblocks = runs[nruns].iovcnt = j - i;
+	runs[nruns].iov = &iov[i];
+	nruns++;
+    }
+
+    if (disk_submit(1, runs, nruns) < 0)
+	retstat = -1;
+    else
+	for (k = 0; k < ndirty; k++)
+	    dirty[k]->dirty = 0;
+    pthread_mutex_unlock(&block_lock);
+
+    free(dirty);
+    free(iov);
+    free(runs);
+    return retstat;
+}
+
+/** Flush the cache and make the disk file durable
+ *
+ * In mmap mode this is where the mapping is msync'ed.
+ */
+int block_sync(void)
+{
+    int retstat = block_flush();
+
+    if (disk_map && msync(disk_map, (size_t)map_blocks * BLOCK_SIZE, MS_SYNC) < 0) {
+	perror("block_sync failed");
+	retstat = -1;
+    }
+
+    if (fsync(fd) < 0) {
+	perror("block_sync failed");
+	retstat = -1;
+    }
+
     return retstat;
 }
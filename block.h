@@ -8,13 +8,46 @@
 #ifndef _BLOCK_H_
 #define _BLOCK_H_
 
-#define BLOCK_SIZE 512
+#include <stddef.h>
 
-int fd = -1;
+// the block size is chosen when a disk is formatted
+#define BLOCK_SIZE_MIN 512
+#define BLOCK_SIZE_MAX 65536
+#define BLOCK_SIZE_DEFAULT 512
+
+// size of every block on the open disk, see block_set_size()
+extern int block_size;
+#define BLOCK_SIZE block_size
+
+// default memory budget for the block cache, in bytes
+#define BLOCK_CACHE_DEFAULT (4 * 1024 * 1024)
+
+// I/O engines, chosen with block_set_engine()
+#define BLOCK_ENGINE_SYNC  0	// pread/pwrite family
+#define BLOCK_ENGINE_URING 1	// batched io_uring submissions
+
+struct block_stats {
+    unsigned long prefetched;		// blocks read ahead into the cache
+    unsigned long prefetch_hits;	// ... that were then asked for
+    unsigned long prefetch_wasted;	// ... evicted or overwritten unused
+};
 
 void disk_open(const char* diskfile_path);
 void disk_close();
+int block_set_size(int size);
+void block_set_engine(int e);
+int block_engine(void);
+void block_set_mmap(int nblocks);
+void block_cache_init(size_t budget);
 int block_read(const int block_num, void *buf);
 int block_write(const int block_num, const void *buf);
+const void *block_ptr(const int block_num);
+int block_readv(const int *block_nums, int count, void *buf);
+int block_writev(const int *block_nums, int count, const void *buf);
+int block_prefetch(const int *block_nums, int count);
+int block_discard(const int *block_nums, int count);
+void block_get_stats(struct block_stats *st);
+int block_flush(void);
+int block_sync(void);
 
 #endif
@@ -0,0 +1,164 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Compare the block layer's I/O engines on the same disk image.
+
+  usage:  block_bench benchFile [nblocks [rounds]]
+
+  The flush workload overwrites blocks all over the file, so benchFile
+  must be a scratch file, not a disk holding a filesystem; one that
+  starts with an sfs superblock is refused.  nblocks defaults to the
+  size of the file, or BENCH_BLOCKS if it is new, and the file is grown
+  to nblocks blocks if it is smaller.  Each engine runs the same three
+  workloads against it:
+
+    seq-read    block_readv of 8 adjacent blocks (one run per call)
+    scat-read   block_readv of 32 scattered blocks (32 runs per call)
+    flush       32 scattered block_writes followed by block_flush
+*/
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "block.h"
+#include "layout.h"
+
+#define BENCH_BLOCKS 8192
+#define SEQ_BLOCKS  8
+#define SCAT_BLOCKS 32
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *engine, const char *test, int rounds,
+		   int blocks, double secs)
+{
+    printf("%-6s %-10s %8d calls %10.1f us/call %10.1f MB/s\n",
+	   engine, test, rounds, secs * 1e6 / rounds,
+	   (double)rounds * blocks * BLOCK_SIZE / secs / 1e6);
+}
+
+static void scatter(int *nums, int n, int nblocks)
+{
+    int i;
+
+    // every other block, so no two requests are adjacent
+    for (i = 0; i < n; i++)
+	nums[i] = (rand() % (nblocks / 2)) * 2;
+}
+
+static void run(int e, const char *diskfile, int nblocks, int rounds)
+{
+    const char *name = e == BLOCK_ENGINE_URING ? "uring" : "sync";
+    char *buf = malloc(SCAT_BLOCKS * BLOCK_SIZE);
+    int nums[SCAT_BLOCKS];
+    double t;
+    int i, j;
+
+    block_set_engine(e);
+    block_cache_init(BLOCK_CACHE_DEFAULT);
+    disk_open(diskfile);
+    if (block_engine() != e) {
+	printf("%-6s unavailable\n", name);
+	disk_close();
+	free(buf);
+	return;
+    }
+
+    srand(1);
+    t = now();
+    for (i = 0; i < rounds; i++) {
+	int start = rand() % (nblocks - SEQ_BLOCKS);
+	for (j = 0; j < SEQ_BLOCKS; j++)
+	    nums[j] = start + j;
+	block_readv(nums, SEQ_BLOCKS, buf);
+    }
+    report(name, "seq-read", rounds, SEQ_BLOCKS, now() - t);
+
+    t = now();
+    for (i = 0; i < rounds; i++) {
+	scatter(nums, SCAT_BLOCKS, nblocks);
+	block_readv(nums, SCAT_BLOCKS, buf);
+    }
+    report(name, "scat-read", rounds, SCAT_BLOCKS, now() - t);
+
+    memset(buf, 'x', BLOCK_SIZE);
+    t = now();
+    for (i = 0; i < rounds; i++) {
+	scatter(nums, SCAT_BLOCKS, nblocks);
+	for (j = 0; j < SCAT_BLOCKS; j++)
+	    block_write(nums[j], buf);
+	block_flush();
+    }
+    report(name, "flush", rounds, SCAT_BLOCKS, now() - t);
+
+    disk_close();
+    free(buf);
+}
+
+int main(int argc, char *argv[])
+{
+    int nblocks = 0;
+    int rounds = 10000;
+    unsigned magic = 0;
+    off_t len;
+    int fd;
+
+    if (argc < 2) {
+	fprintf(stderr, "usage:  block_bench benchFile [nblocks [rounds]]\n");
+	return 1;
+    }
+
+    fd = open(argv[1], O_CREAT|O_RDWR, 0600);
+    if (fd < 0 || (len = lseek(fd, 0, SEEK_END)) < 0) {
+	perror("block_bench");
+	return 1;
+    }
+    if (pread(fd, &magic, sizeof(magic), 0) == sizeof(magic) &&
+	magic == SFS_MAGIC) {
+	fprintf(stderr, "block_bench: %s holds an sfs filesystem, "
+		"use a scratch file\n", argv[1]);
+	close(fd);
+	return 1;
+    }
+
+    if (argc > 2)
+	nblocks = atoi(argv[2]);
+    else if (len >= (off_t)2 * SCAT_BLOCKS * BLOCK_SIZE)
+	nblocks = len / BLOCK_SIZE < INT_MAX ? len / BLOCK_SIZE : INT_MAX;
+    else
+	nblocks = BENCH_BLOCKS;
+    if (argc > 3)
+	rounds = atoi(argv[3]);
+    if (nblocks < 2 * SCAT_BLOCKS || rounds <= 0) {
+	fprintf(stderr, "block_bench: need at least %d blocks and 1 round\n",
+		2 * SCAT_BLOCKS);
+	close(fd);
+	return 1;
+    }
+
+    if (len < (off_t)nblocks * BLOCK_SIZE &&
+	ftruncate(fd, (off_t)nblocks * BLOCK_SIZE) < 0) {
+	perror("block_bench");
+	close(fd);
+	return 1;
+    }
+    close(fd);
+
+    run(BLOCK_ENGINE_SYNC, argv[1], nblocks, rounds);
+    run(BLOCK_ENGINE_URING, argv[1], nblocks, rounds);
+
+    return 0;
+}
@@ -0,0 +1,91 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "layout.h"
+
+/** Work out where everything goes on a disk of @block_size blocks */
+void sfs_layout(geometry *g, int block_size)
+{
+    g->block_size = block_size;
+    g->inodes_per_block = block_size / sizeof(inode);
+    g->data_map_start = 1;
+    g->data_map_blocks = (SFS_NUM_DATABLOCKS + 8*block_size - 1) / (8*block_size);
+    g->inode_start = g->data_map_start + g->data_map_blocks;
+    g->inode_blocks = (SFS_NUM_INODES + g->inodes_per_block - 1) / g->inodes_per_block;
+    g->data_start = g->inode_start + g->inode_blocks;
+}
+
+/** Read the superblock of @diskfile into @sb and check it
+ *
+ * This runs before the block layer is set up, since the block size
+ * comes from the superblock itself.  The geometry must be the one
+ * sfs_layout() gives for its block size, the counts must match what
+ * this build was compiled for, and the file must be long enough to
+ * hold every data block.  Returns 0, or -errno after saying what is
+ * wrong on stderr.
+ */
+int sfs_super_read(const char *diskfile, superblock *sb)
+{
+    struct stat st;
+    geometry g;
+    ssize_t n;
+    int fd, bs;
+
+    fd = open(diskfile, O_RDONLY);
+    if (fd < 0) {
+	int err = errno;
+	fprintf(stderr, "sfs: %s: %s\n", diskfile, strerror(err));
+	return -err;
+    }
+    n = pread(fd, sb, sizeof(*sb), 0);
+    if (n < 0 || fstat(fd, &st) < 0) {
+	int err = errno;
+	fprintf(stderr, "sfs: %s: %s\n", diskfile, strerror(err));
+	close(fd);
+	return -err;
+    }
+    close(fd);
+
+    if (n < (ssize_t)sizeof(*sb) || sb->magic != SFS_MAGIC) {
+	fprintf(stderr, "sfs: %s: not an sfs disk, format it with mkfs.sfs\n",
+		diskfile);
+	return -EINVAL;
+    }
+    bs = sb->geo.block_size;
+    if (bs < BLOCK_SIZE_MIN || bs > BLOCK_SIZE_MAX || (bs & (bs - 1))) {
+	fprintf(stderr, "sfs: %s: bad block size %d\n", diskfile, bs);
+	return -EINVAL;
+    }
+    sfs_layout(&g, bs);
+    if (memcmp(&g, &sb->geo, sizeof(g)) != 0 ||
+	sb->total_num_inodes != SFS_NUM_INODES ||
+	sb->total_num_datablocks != SFS_NUM_DATABLOCKS) {
+	fprintf(stderr, "sfs: %s: geometry does not match this build "
+		"(%d inodes, %d data blocks)\n", diskfile,
+		sb->total_num_inodes, sb->total_num_datablocks);
+	return -EINVAL;
+    }
+    if (sb->num_inodes < 0 || sb->num_inodes > SFS_NUM_INODES ||
+	sb->num_datablocks < 0 || sb->num_datablocks > SFS_NUM_DATABLOCKS) {
+	fprintf(stderr, "sfs: %s: bad free counts\n", diskfile);
+	return -EINVAL;
+    }
+    if (st.st_size < (off_t)(g.data_start + SFS_NUM_DATABLOCKS) * bs) {
+	fprintf(stderr, "sfs: %s: truncated, %lld bytes\n", diskfile,
+		(long long)st.st_size);
+	return -EINVAL;
+    }
+
+    return 0;
+}
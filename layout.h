@@ -0,0 +1,131 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  The on-disk format, shared by the filesystem and mkfs.sfs.
+*/
+
+#ifndef _LAYOUT_H_
+#define _LAYOUT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "block.h"
+#include "bitmap.h"
+
+// number of inodes (and directory entries) and data blocks on a disk
+#define SFS_NUM_INODES 100
+#define SFS_NUM_DATABLOCKS 1100
+// extents held in the inode itself
+#define INODE_EXTENTS 4
+
+// a run of len data blocks starting at data block start; the extents
+// of an inode map the file's blocks in order, and len == 0 ends them
+typedef struct extent_struct{
+  int start;
+  int len;
+}extent;
+
+// start of an extent that is a hole: len file blocks with no data
+// blocks behind them, which read as zeroes
+#define EXT_HOLE -2
+
+/* Extents past the first INODE_EXTENTS live in indirect blocks: the
+ * single-indirect block is an array of extents, the double-indirect
+ * block an array of disk block numbers of such arrays, and the
+ * triple-indirect block one more level of those.  Indirect pointers
+ * are disk block numbers, 0 when absent. */
+#define TYPE_DIR  1
+#define TYPE_FILE 2
+
+/* A file starts out inline: its contents live in the inode, which is
+ * sized to 256 bytes to make room for them, and it takes no data
+ * block until a write carries it past INODE_INLINE_MAX bytes. */
+#define INODE_INLINE_MAX 188
+#define INODE_INLINE 1//flags: the contents are in data[], not in blocks
+
+typedef struct inode_struct{
+  int type;//TYPE_DIR or TYPE_FILE, 0 when free
+  int link_count;//how many hardlinks are pointing to it
+  int64_t size_written;//number of bytes of remaining space in file
+  int mode;//read or write mode?
+  extent ext[INODE_EXTENTS];
+  int indirect[3];//single, double and triple indirect
+  int flags;
+  char data[INODE_INLINE_MAX];//inline contents, zero past the end
+}inode;
+
+// the root directory, made by mkfs.sfs
+#define ROOT_INO 0
+
+/* A directory is an inode of type 1 whose blocks hold a B+tree keyed
+ * by name hash.  Directory block 0 is always the root of the tree.
+ * Leaves hold named records sorted by hash; index blocks hold the lowest
+ * hash under each child and the child's directory block, sorted the
+ * same way.  Entries with equal hashes are never split across leaves,
+ * so a lookup reads one block per level. */
+typedef struct dir_node_struct{
+  int level;//0 for a leaf, else the height above the leaves
+  int count;
+}dir_node;
+
+/* Leaf records are packed from the start of the block, as long as
+ * their name, rounded up so the next one is aligned.  A typical name
+ * takes 24 bytes instead of a whole direntry. */
+typedef struct dir_rec_struct{
+  unsigned hash;
+  int inode_num;
+  unsigned short rec_len;//bytes from this record to the next
+  unsigned char name_len;
+  char name[];//name_len bytes, no terminator
+}dir_rec;
+
+typedef struct dir_index_entry_struct{
+  unsigned hash;//lowest hash in the subtree
+  int fblock;//directory block at the top of the subtree
+}dir_index_entry;
+
+#define DIR_MAX_DEPTH 8
+
+#define DIR_REC(n, off) ((dir_rec *)((char *)(n) + sizeof(dir_node) + (off)))
+#define DIR_REC_LEN(len) ((int)((offsetof(dir_rec, name) + (len) + 3) & ~3))
+#define DIR_INDEX(n) ((dir_index_entry *)((dir_node *)(n) + 1))
+#define DIR_LEAF_SPACE ((int)(BLOCK_SIZE - sizeof(dir_node)))
+#define DIR_INDEX_MAX ((int)((BLOCK_SIZE - sizeof(dir_node)) / sizeof(dir_index_entry)))
+
+// where everything lives on the disk, derived from the block size by
+// sfs_layout() when the disk is formatted
+typedef struct geometry_struct{
+  int block_size;
+  int inodes_per_block;
+  int data_map_start;//packed bitmap, one bit per data block
+  int data_map_blocks;
+  int inode_start;
+  int inode_blocks;
+  int data_start;
+}geometry;
+
+#define SFS_MAGIC 0x53465331//"SFS1"
+
+/* Block 0.  num_inodes and num_datablocks count what is free.  clean
+ * is cleared while the disk is mounted and set again at unmount, so a
+ * mount can tell the last one did not finish. */
+typedef struct superblock_struct{
+  unsigned magic;//SFS_MAGIC
+  int clean;
+  int num_inodes;
+  int num_datablocks;
+  int total_num_inodes;
+  int total_num_datablocks;
+  geometry geo;
+  uint64_t inode_map[BITMAP_WORDS(SFS_NUM_INODES)];//one bit per inode
+  uint64_t orphan_map[BITMAP_WORDS(SFS_NUM_INODES)];//blocks still to reclaim
+}superblock;
+
+void sfs_layout(geometry *g, int block_size);
+int sfs_super_read(const char *diskfile, superblock *sb);
+
+#endif
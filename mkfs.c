@@ -0,0 +1,151 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Format a disk image for sfs.
+
+  usage:  mkfs.sfs [-b blocksize] diskFile
+
+  The image is created, or grown if it is too small to hold the
+  filesystem; a larger image is left at its size.  Everything sfs
+  reads at mount is written here: the superblock, the data map, the
+  inode table and the root directory.  The rest of the data area is
+  punched out of the image rather than written, so reformatting a
+  full image gives its space back.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "layout.h"
+
+static void usage(void)
+{
+    fprintf(stderr, "usage:  mkfs.sfs [-b blocksize] diskFile\n");
+    fprintf(stderr, "    -b N   block size, a power of two from %d to %d (default %d)\n",
+	    BLOCK_SIZE_MIN, BLOCK_SIZE_MAX, BLOCK_SIZE_DEFAULT);
+    exit(1);
+}
+
+// make @path at least @size bytes long
+static int disk_size(const char *path, off_t size)
+{
+    struct stat st;
+    int fd = open(path, O_CREAT|O_RDWR, 0600);
+
+    if (fd < 0)
+	return -1;
+    if (fstat(fd, &st) < 0 ||
+	(st.st_size < size && ftruncate(fd, size) < 0)) {
+	int err = errno;
+	close(fd);
+	errno = err;
+	return -1;
+    }
+    return close(fd);
+}
+
+int main(int argc, char *argv[])
+{
+    int bs = BLOCK_SIZE_DEFAULT;
+    geometry geo;
+    superblock *sb;
+    uint64_t *data_map;
+    int *data_blocks;
+    inode *itable;
+    char *buf;
+    int c, i, e;
+
+    while ((c = getopt(argc, argv, "b:")) != -1) {
+	switch (c) {
+	case 'b':
+	    bs = atoi(optarg);
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (optind != argc - 1)
+	usage();
+    if (block_set_size(bs) < 0) {
+	fprintf(stderr, "mkfs.sfs: bad block size %d\n", bs);
+	usage();
+    }
+
+    sfs_layout(&geo, bs);
+    if (disk_size(argv[optind], (off_t)(geo.data_start + SFS_NUM_DATABLOCKS) * bs) < 0) {
+	perror(argv[optind]);
+	return 1;
+    }
+    block_cache_init(0);
+    disk_open(argv[optind]);
+
+    buf = calloc(1, bs);
+    data_map = calloc(geo.data_map_blocks, bs);
+    data_blocks = malloc(SFS_NUM_DATABLOCKS * sizeof(int));
+    if (!buf || !data_map || !data_blocks) {
+	perror("mkfs.sfs");
+	return 1;
+    }
+
+    // the root directory takes inode ROOT_INO and data block 0
+    sb = (superblock *)buf;
+    sb->magic = SFS_MAGIC;
+    sb->clean = 1;
+    sb->num_inodes = SFS_NUM_INODES - 1;
+    sb->num_datablocks = SFS_NUM_DATABLOCKS - 1;
+    sb->total_num_inodes = SFS_NUM_INODES;
+    sb->total_num_datablocks = SFS_NUM_DATABLOCKS;
+    sb->geo = geo;
+    bitmap_init(sb->inode_map, BITMAP_WORDS(SFS_NUM_INODES), SFS_NUM_INODES);
+    bitmap_set(sb->inode_map, ROOT_INO);
+    block_write(0, buf);
+
+    bitmap_init(data_map, geo.data_map_blocks * bs / sizeof(uint64_t),
+		SFS_NUM_DATABLOCKS);
+    bitmap_set(data_map, 0);
+    for (i = 0; i < geo.data_map_blocks; i++)
+	block_write(geo.data_map_start + i, (char *)data_map + (size_t)i * bs);
+
+    // every inode free, with no extents
+    itable = (inode *)buf;
+    memset(buf, 0, bs);
+    for (i = 0; i < geo.inodes_per_block; i++)
+	for (e = 0; e < INODE_EXTENTS; e++)
+	    itable[i].ext[e].start = -1;
+    for (i = 1; i < geo.inode_blocks; i++)
+	block_write(geo.inode_start + i, buf);
+    itable[ROOT_INO].type = TYPE_DIR;
+    itable[ROOT_INO].link_count = 2;
+    itable[ROOT_INO].mode = S_IFDIR | 0777;
+    itable[ROOT_INO].size_written = bs;
+    itable[ROOT_INO].ext[0].start = 0;
+    itable[ROOT_INO].ext[0].len = 1;
+    block_write(geo.inode_start, buf);
+
+    for (i = 0; i < SFS_NUM_DATABLOCKS; i++)
+	data_blocks[i] = geo.data_start + i;
+    block_discard(data_blocks, SFS_NUM_DATABLOCKS);
+
+    // an empty leaf as the root of its tree
+    memset(buf, 0, bs);
+    block_write(geo.data_start, buf);
+
+    if (block_sync() < 0)
+	return 1;
+    disk_close();
+    free(data_blocks);
+    free(data_map);
+    free(buf);
+
+    printf("%s: %d byte blocks, %d inodes, %d data blocks from block %d\n",
+	   argv[optind], bs, SFS_NUM_INODES, SFS_NUM_DATABLOCKS, geo.data_start);
+    return 0;
+}
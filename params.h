@@ -26,7 +26,15 @@
 struct sfs_state {
     FILE *logfile;
     char *diskfile;
+    unsigned long cache_kb;	// block cache budget, -o cache_kb=N
+    char *engine;		// block I/O engine, -o engine=sync|uring
+    int use_mmap;		// map the disk file, -o mmap
+    double negative_timeout;	// kernel cache time for misses, -o negative_timeout=T
+    int lowlevel;		// use the inode-based fuse API, -o lowlevel
 };
-#define SFS_DATA ((struct sfs_state *) fuse_get_context()->private_data)
+// a global rather than fuse's private_data, which the low-level API
+// has no fuse_get_context() for
+extern struct sfs_state *sfs_state;
+#define SFS_DATA sfs_state
 
 #endif
@@ -7,6 +7,9 @@
 
 #include "params.h"
 #include "block.h"
+#include "bitmap.h"
+#include "layout.h"
+#include "sfs.h"
 
 #include <ctype.h>
 #include <dirent.h>
@@ -15,9 +18,13 @@
 #include <fuse.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
 
@@ -27,6 +34,8 @@
 
 #include "log.h"
 
+struct sfs_state *sfs_state;
+
 ///////////////////////////////////////////////////////////
 //
 // Prototypes for all these functions, and the C-style comments,
@@ -50,37 +59,1518 @@ static int sfs_error(char *str)
   return ret;
 }
 
-typedef struct superblock_struct{
-  char sfsname[5];
-  int num_inodes;
-  int num_datablocks; 
-  int total_num_inodes;
-  int total_num_datablocks;
-  char inode_map[100];
-}superblock;
-
-typedef struct inode_struct{
-  int type;//1 if directory, 2 if regular file
-  int link_count;//how many hardlinks are pointing to it
-  int size_written;//number of bytes of remaining space in file
-  int mode;//read or write mode?
-  int db[11];
-}inode;
-
-typedef struct inode_array_struct{
-  inode i[5];
-}inode_array;
-
+// one name in a directory: a single path component, without slashes;
+// this is how dir_walk() hands out names, leaves store them packed
 typedef struct direntry_struct{
   char name[120];
   int inode_num;
 }direntry;
 
-typedef struct direntry_array_struct{
-  direntry d[4];
-}direntry_array;
+// called by dir_walk() with each entry and its position; nonzero stops
+typedef int (*dir_walk_fn)(void *arg, const direntry *de, off_t pos);
+
+/* Where an entry sits in hash order: its hash, then its rank among
+ * the entries sharing that hash.  Readdir offsets are positions, so a
+ * listing resumes at the right place however the tree has split in
+ * between; offsets 0 and 1 are left for "." and "..". */
+#define DIR_POS(h, rank)  ((((off_t)(h) << 16) | (rank)) + 2)
+#define DIR_POS_HASH(pos) ((unsigned)(((pos) - 2) >> 16))
+
+// in-memory copy of the geometry in the superblock
+static geometry geo;
+
+// read-ahead window bounds, in blocks
+#define RA_MIN 2
+#define RA_MAX 32
+
+/* Per-open state, hung off fuse_file_info->fh by open, create and
+ * opendir, so I/O on an open file goes straight to its inode without
+ * walking the path again. */
+typedef struct sfs_file_struct{
+  int inode_num;//the open inode, kept until release even if unlinked
+  struct extent_map_struct *map;//its block map, NULL for directories
+  pthread_mutex_t lock;//reads through one handle can run in parallel
+  off_t next_offset;//where a sequential reader reads next
+  int ra_window;//blocks to read ahead, 0 while access looks random
+  int ra_next;//first file block not read ahead yet
+  char *wbuf;//staging for write, used under the inode's write lock
+  size_t wbuf_size;
+}sfs_file;
+
+#define SFS_FILE(fi) ((fi) ? (sfs_file *)(uintptr_t)(fi)->fh : NULL)
+
+/* Locking, so that FUSE's multithreaded loop can be used.  Locks are
+ * always taken in this order:
+ *
+ *   dir_lock      (rwlock) every directory: their blocks, their inodes
+ *                 and the names in the dentry cache
+ *   dcache_lock   (mutex) filling the dentry cache under a shared
+ *                 dir_lock
+ *   inode_locks   (rwlock) one per inode, covering the inode and its
+ *                 data blocks; more than one in ascending inode order
+ *   sfs_file lock (mutex) the read-ahead state of one open file
+ *   alloc_lock    (mutex) the superblock, inode map and data maps
+ *   emap_lock     (mutex) loading an inode's cached extent map
+ *   itable_lock   (mutex) the inode cache and its writeback
+ *   block layer   (block.c has its own)
+ *
+ * A path is looked up under dir_lock and its inode locked before
+ * dir_lock is dropped.  Unlink and rmdir hold dir_lock for writing
+ * and then wait for the inode's write lock, so an inode cannot be
+ * freed under an operation that found it.  A newly created inode is unreachable
+ * until its direntry is written, so create does not lock it.
+ * Directory inodes are covered by dir_lock, not their inode lock. */
+static pthread_rwlock_t dir_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_rwlock_t inode_locks[SFS_NUM_INODES];
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t itable_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// the allocation bitmaps live in memory and are written through to the
+// superblock and data map blocks, all under alloc_lock; each keeps a
+// next-fit cursor
+static uint64_t inode_map[BITMAP_WORDS(SFS_NUM_INODES)];
+static uint64_t *data_map;//geo.data_map_blocks whole blocks
+static int inode_cursor, data_cursor;
+
+/* Orphans: inodes with blocks the reclaimer still has to free, either
+ * unlinked ones (link_count 0), which go entirely, or truncated files,
+ * which lose the blocks past their size.  The set is kept beside the
+ * inode map, in the superblock, so one left behind by a crash or an
+ * unmount is picked up again at mount.  Under alloc_lock. */
+static uint64_t orphan_map[BITMAP_WORDS(SFS_NUM_INODES)];
+
+// blocks the reclaimer frees between taking and dropping its locks
+#define RECLAIM_BATCH 256
+
+#define INODE_BLOCK(n)  (geo.inode_start + (n)/geo.inodes_per_block)
+#define INODE_INDEX(n)  ((n)%geo.inodes_per_block)
+#define DATA_BLOCK(db)  (geo.data_start + (db))
+#define DATA_MAP_BLOCK(db) (geo.data_map_start + (db)/(8*geo.block_size))
+
+/* The inode table is cached in memory, decoded, one inode table block
+ * at a time as inodes in it are first used.  inode_put only updates
+ * the cache and marks the inode dirty; dirty inodes reach the disk in
+ * one batch, a whole inode table block each, from inode_flush.  That
+ * runs on fsync and flush, every INODE_WRITEBACK_SECS from the
+ * writeback thread, at unmount, and from inode_put itself once
+ * INODE_DIRTY_MAX inodes are waiting.  All of it is under itable_lock. */
+#define INODE_DIRTY_MAX 32
+#define INODE_WRITEBACK_SECS 5
+
+typedef struct icache_entry_struct{
+  inode ino;
+  char loaded;
+  char dirty;
+}icache_entry;
+
+static icache_entry icache[SFS_NUM_INODES];
+static int icache_ndirty;
+static unsigned long icache_batches, icache_blocks;
+
+// forget the cached table, after the disk's has been rewritten
+static void icache_reset(void)
+{
+  memset(icache, 0, sizeof(icache));
+  icache_ndirty = 0;
+}
+
+// read the inode table block holding inode @num into the cache
+static void icache_load(int num)
+{
+  char buf[BLOCK_SIZE];
+  int first = num - INODE_INDEX(num), k;
+  block_read(INODE_BLOCK(num), buf);
+  for (k = first; k < first + geo.inodes_per_block && k < SFS_NUM_INODES; k++) {
+    icache[k].ino = ((inode *)buf)[k - first];
+    icache[k].loaded = 1;
+  }
+}
+
+/* Write every dirty inode back, with one block_writev for all their
+ * blocks.  An inode stays dirty until its block is written, so one
+ * that failed goes out again next time.  Returns 0, or -1 if any
+ * block could not be written. */
+static int icache_writeback(void)
+{
+  int nblocks = 0, k, b, retstat = 0;
+  if (icache_ndirty == 0)
+    return 0;
 
+  int *nums = malloc(geo.inode_blocks * sizeof(int));
+  char *bufs = malloc((size_t)geo.inode_blocks * BLOCK_SIZE);
+  if (!nums || !bufs) {
+    // no room to batch: one block at a time through the cache
+    char buf[BLOCK_SIZE];
+    for (k = 0; k < SFS_NUM_INODES; k++) {
+      if (!icache[k].dirty)
+        continue;
+      if (block_read(INODE_BLOCK(k), buf) < 0) {
+        retstat = -1;
+        continue;
+      }
+      ((inode *)buf)[INODE_INDEX(k)] = icache[k].ino;
+      if (block_write(INODE_BLOCK(k), buf) < 0) {
+        retstat = -1;
+        continue;
+      }
+      icache[k].dirty = 0;
+      icache_ndirty--;
+    }
+  } else {
+    for (b = 0; b < geo.inode_blocks; b++) {
+      int first = b * geo.inodes_per_block, dirty = 0;
+      char *buf = bufs + (size_t)nblocks * BLOCK_SIZE;
+      // a block is loaded whole, so a dirty inode means all of it is here
+      memset(buf, 0, BLOCK_SIZE);
+      for (k = first; k < first + geo.inodes_per_block && k < SFS_NUM_INODES; k++) {
+        ((inode *)buf)[k - first] = icache[k].ino;
+        dirty |= icache[k].dirty;
+      }
+      if (dirty)
+        nums[nblocks++] = geo.inode_start + b;
+    }
+    if (block_writev(nums, nblocks, bufs) < 0) {
+      retstat = -1;
+    } else {
+      for (k = 0; k < SFS_NUM_INODES; k++)
+        icache[k].dirty = 0;
+      icache_ndirty = 0;
+      icache_blocks += nblocks;
+    }
+  }
+  icache_batches++;
+  free(nums);
+  free(bufs);
+  return retstat;
+}
+
+// copy inode @num out of the inode table
+static void inode_get(int num, inode *ino)
+{
+  pthread_mutex_lock(&itable_lock);
+  if (!icache[num].loaded)
+    icache_load(num);
+  *ino = icache[num].ino;
+  pthread_mutex_unlock(&itable_lock);
+}
 
+// store inode @num; it is written back later unless nothing changed
+static void inode_put(int num, const inode *ino)
+{
+  pthread_mutex_lock(&itable_lock);
+  if (!icache[num].loaded)
+    icache_load(num);
+  if (memcmp(&icache[num].ino, ino, sizeof(inode)) != 0) {
+    icache[num].ino = *ino;
+    if (!icache[num].dirty) {
+      icache[num].dirty = 1;
+      icache_ndirty++;
+    }
+    if (icache_ndirty >= INODE_DIRTY_MAX)
+      icache_writeback();
+  }
+  pthread_mutex_unlock(&itable_lock);
+}
+
+// write all dirty inodes back to the disk; returns 0, or -1 on error
+static int inode_flush(void)
+{
+  pthread_mutex_lock(&itable_lock);
+  int retstat = icache_writeback();
+  pthread_mutex_unlock(&itable_lock);
+  return retstat;
+}
+
+/* The writeback thread flushes dirty inodes every
+ * INODE_WRITEBACK_SECS until sfs_destroy stops it. */
+static pthread_t writeback_thread;
+static pthread_mutex_t writeback_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writeback_cond = PTHREAD_COND_INITIALIZER;
+static int writeback_running;
+
+static void *writeback_main(void *arg)
+{
+  struct timespec ts;
+  pthread_mutex_lock(&writeback_lock);
+  while (writeback_running) {
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += INODE_WRITEBACK_SECS;
+    if (pthread_cond_timedwait(&writeback_cond, &writeback_lock, &ts) == ETIMEDOUT) {
+      pthread_mutex_unlock(&writeback_lock);
+      inode_flush();
+      pthread_mutex_lock(&writeback_lock);
+    }
+  }
+  pthread_mutex_unlock(&writeback_lock);
+  return NULL;
+}
+
+static void writeback_start(void)
+{
+  writeback_running = 1;
+  if (pthread_create(&writeback_thread, NULL, writeback_main, NULL) != 0) {
+    log_msg("writeback thread not started, inodes are written on fsync and unmount\n");
+    writeback_running = 0;
+  }
+}
+
+static void writeback_stop(void)
+{
+  pthread_mutex_lock(&writeback_lock);
+  int running = writeback_running;
+  writeback_running = 0;
+  pthread_cond_signal(&writeback_cond);
+  pthread_mutex_unlock(&writeback_lock);
+  if (running)
+    pthread_join(writeback_thread, NULL);
+}
+
+/* The reclaimer thread frees the orphans' blocks in the background,
+ * RECLAIM_BATCH at a time with its locks dropped in between, so
+ * unlink and truncate return at once and foreground I/O is not held
+ * up for long.  reclaim_kick() wakes it when there is new work. */
+static pthread_t reclaim_thread;
+static pthread_mutex_t reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reclaim_cond = PTHREAD_COND_INITIALIZER;
+static int reclaim_running, reclaim_pending;
+static unsigned long reclaim_batches, reclaim_freed;
+
+static void *reclaim_main(void *arg);
+
+static void reclaim_kick(void)
+{
+  pthread_mutex_lock(&reclaim_lock);
+  reclaim_pending = 1;
+  pthread_cond_signal(&reclaim_cond);
+  pthread_mutex_unlock(&reclaim_lock);
+}
+
+// start the reclaimer, with the orphans left from the last mount as work
+static void reclaim_start(void)
+{
+  reclaim_running = 1;
+  reclaim_pending = 1;
+  if (pthread_create(&reclaim_thread, NULL, reclaim_main, NULL) != 0) {
+    log_msg("reclaimer not started, orphans stay until the next mount\n");
+    reclaim_running = 0;
+  }
+}
+
+// stop the reclaimer after its current batch; what is left stays orphaned
+static void reclaim_stop(void)
+{
+  pthread_mutex_lock(&reclaim_lock);
+  int running = reclaim_running;
+  reclaim_running = 0;
+  pthread_cond_signal(&reclaim_cond);
+  pthread_mutex_unlock(&reclaim_lock);
+  if (running)
+    pthread_join(reclaim_thread, NULL);
+}
+
+// write back the data map block that holds the bit for @db
+static void data_map_write(int db)
+{
+  int b = DATA_MAP_BLOCK(db);
+  block_write(b, (char *)data_map + (size_t)(b - geo.data_map_start)*BLOCK_SIZE);
+}
+
+// allocate a data block; returns its number, or -1 if the disk is full
+static int data_alloc(superblock *sb)
+{
+  int db = bitmap_alloc(data_map, SFS_NUM_DATABLOCKS, &data_cursor);
+  if (db < 0)
+    return -1;
+  sb->num_datablocks--;
+  data_map_write(db);
+  return db;
+}
+
+// allocate data block @db if it is free; returns it, or -1
+static int data_alloc_at(superblock *sb, int db)
+{
+  if (db >= SFS_NUM_DATABLOCKS || bitmap_test(data_map, db))
+    return -1;
+  bitmap_set(data_map, db);
+  // keep other files from starting right behind a growing one
+  if (data_cursor == db)
+    data_cursor = db + 1 < SFS_NUM_DATABLOCKS ? db + 1 : 0;
+  sb->num_datablocks--;
+  data_map_write(db);
+  return db;
+}
+
+// free @len data blocks from @db, writing each map block once
+static void data_free(superblock *sb, int db, int len)
+{
+  int x;
+  for (x = db; x < db + len; x++) {
+    bitmap_clear(data_map, x);
+    if (x == db + len - 1 || DATA_MAP_BLOCK(x + 1) != DATA_MAP_BLOCK(x))
+      data_map_write(x);
+  }
+  sb->num_datablocks += len;
+}
+
+// extents per indirect block, and block numbers per pointer block
+#define IND_EXTENTS ((int)(BLOCK_SIZE/sizeof(extent)))
+#define IND_PTRS    ((int)(BLOCK_SIZE/sizeof(int)))
+
+// allocate a zeroed indirect block; returns its disk block, or 0
+static int ind_alloc(superblock *sb)
+{
+  char buf[BLOCK_SIZE];
+  int db = data_alloc(sb);
+  if (db < 0)
+    return 0;
+  memset(buf, 0, BLOCK_SIZE);
+  block_write(DATA_BLOCK(db), buf);
+  return DATA_BLOCK(db);
+}
+
+/* Find the indirect block and slot that hold extent @i (counting the
+ * ones in the inode).  Returns the disk block, or 0 when it is not
+ * there; with @sb set, missing indirect blocks are allocated on the
+ * way down.  The caller holds the inode lock. */
+static int ext_locate(superblock *sb, inode *ino, int i, int *slot)
+{
+  char buf[BLOCK_SIZE];
+  long span = IND_EXTENTS;//extents under one tree of depth d
+  int d;
+
+  i -= INODE_EXTENTS;
+  for (d = 0; d < 3 && i >= span; d++) {
+    i -= span;
+    span *= IND_PTRS;
+  }
+  if (d == 3)
+    return 0;
+
+  int blk = ino->indirect[d];
+  if (!blk) {
+    if (!sb || !(blk = ind_alloc(sb)))
+      return 0;
+    ino->indirect[d] = blk;
+  }
+  for (; d > 0; d--) {
+    int *ptrs = (int *)buf;
+    span /= IND_PTRS;
+    block_read(blk, buf);
+    int idx = i / span;
+    i %= span;
+    if (!ptrs[idx]) {
+      if (!sb || !(ptrs[idx] = ind_alloc(sb)))
+        return 0;
+      block_write(blk, buf);
+    }
+    blk = ptrs[idx];
+  }
+  *slot = i;
+  return blk;
+}
+
+// extent @i of @ino, len 0 past the last one
+static extent ext_get(const inode *ino, int i)
+{
+  char buf[BLOCK_SIZE];
+  extent none = { 0, 0 };
+  int slot;
+
+  if (i < INODE_EXTENTS)
+    return ino->ext[i];
+  int blk = ext_locate(NULL, (inode *)ino, i, &slot);
+  if (!blk)
+    return none;
+  const extent *exts = block_ptr(blk);
+  if (!exts) {
+    block_read(blk, buf);
+    exts = (extent *)buf;
+  }
+  return exts[slot];
+}
+
+// store extent @i of @ino; the caller holds alloc_lock
+static int ext_set(superblock *sb, inode *ino, int i, const extent *ex)
+{
+  char buf[BLOCK_SIZE];
+  int slot;
+
+  if (i < INODE_EXTENTS) {
+    ino->ext[i] = *ex;
+    return 0;
+  }
+  int blk = ext_locate(sb, ino, i, &slot);
+  if (!blk)
+    return -1;
+  block_read(blk, buf);
+  ((extent *)buf)[slot] = *ex;
+  block_write(blk, buf);
+  return 0;
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+  int x = *(const int *)a, y = *(const int *)b;
+  return (x > y) - (x < y);
+}
+
+/* Free an indirect block and, below depth 0, everything under it.
+ * The blocks are added to *@freed, *@nfreed of *@cap used, for the
+ * caller to punch out in one batch before dropping alloc_lock; one
+ * the list has no room for is punched on its own. */
+static void ind_free(superblock *sb, int blk, int depth, int **freed, int *nfreed, int *cap)
+{
+  char buf[BLOCK_SIZE];
+  int x;
+
+  if (depth > 0) {
+    int *ptrs = (int *)buf;
+    block_read(blk, buf);
+    for (x = 0; x < IND_PTRS; x++)
+      if (ptrs[x])
+        ind_free(sb, ptrs[x], depth - 1, freed, nfreed, cap);
+  }
+  if (*nfreed == *cap) {
+    int n = *cap ? *cap * 2 : IND_PTRS;
+    int *p = realloc(*freed, n * sizeof(int));
+    if (p) {
+      *freed = p;
+      *cap = n;
+    }
+  }
+  if (*nfreed < *cap)
+    (*freed)[(*nfreed)++] = blk;
+  else
+    block_discard(&blk, 1);
+  data_free(sb, blk - geo.data_start, 1);
+}
+
+/* In-memory copy of an inode's whole extent list, with the file block
+ * each extent starts at.  It is read from the inode and its indirect
+ * blocks once, so mapping a file block is a binary search rather than
+ * a walk down the indirect chain.  Loaded under emap_lock, since
+ * readers only share the inode lock; changed only by a holder of the
+ * inode's write lock. */
+typedef struct extent_map_struct{
+  int n;//extents
+  int cap;
+  int nblocks;//file blocks mapped
+  extent *ext;
+  int *fblock;//file block at the start of each extent
+}extent_map;
+
+static extent_map *emaps[SFS_NUM_INODES];
+static pthread_mutex_t emap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// make room for @n extents in @m
+static int emap_reserve(extent_map *m, int n)
+{
+  if (n > m->cap) {
+    int cap = m->cap ? m->cap * 2 : INODE_EXTENTS;
+    while (cap < n)
+      cap *= 2;
+    extent *ext = realloc(m->ext, cap * sizeof(*ext));
+    if (!ext)
+      return -1;
+    m->ext = ext;
+    int *fblock = realloc(m->fblock, cap * sizeof(*fblock));
+    if (!fblock)
+      return -1;
+    m->fblock = fblock;
+    m->cap = cap;
+  }
+  return 0;
+}
+
+static int emap_push(extent_map *m, const extent *ex)
+{
+  if (emap_reserve(m, m->n + 1) < 0)
+    return -1;
+  m->ext[m->n] = *ex;
+  m->fblock[m->n] = m->nblocks;
+  m->n++;
+  m->nblocks += ex->len;
+  return 0;
+}
+
+static void emap_drop(int num)
+{
+  extent_map *m = emaps[num];
+  emaps[num] = NULL;
+  if (m) {
+    free(m->ext);
+    free(m->fblock);
+    free(m);
+  }
+}
+
+// the extent map of inode @num, loading it on first use; NULL if out of memory
+static extent_map *emap_get(int num, const inode *ino)
+{
+  pthread_mutex_lock(&emap_lock);
+  extent_map *m = emaps[num];
+  if (!m && (m = calloc(1, sizeof(*m)))) {
+    int i;
+    extent ex;
+    for (i = 0; (ex = ext_get(ino, i)).len > 0; i++) {
+      if (emap_push(m, &ex) < 0) {
+        free(m->ext);
+        free(m->fblock);
+        free(m);
+        m = NULL;
+        break;
+      }
+    }
+    emaps[num] = m;
+  }
+  pthread_mutex_unlock(&emap_lock);
+  return m;
+}
+
+// the extent of @m holding mapped file block @fblock
+static int emap_find(const extent_map *m, int fblock)
+{
+  int lo = 0, hi = m->n - 1;
+  // the last extent starting at or before @fblock
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (m->fblock[mid] <= fblock)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+/* Disk block numbers of file blocks @first .. @first+@count-1 into
+ * @out, 0 for a block in a hole, stopping at the end of the map.
+ * Returns how many there are. */
+static int inode_blocks(const extent_map *m, int first, int count, int *out)
+{
+  int k, n = 0;
+
+  if (first >= m->nblocks || count <= 0)
+    return 0;
+  for (k = emap_find(m, first); k < m->n && n < count; k++) {
+    int x;
+    for (x = first + n - m->fblock[k]; x < m->ext[k].len && n < count; x++)
+      out[n++] = m->ext[k].start == EXT_HOLE ? 0 : DATA_BLOCK(m->ext[k].start + x);
+  }
+  return n;
+}
+
+// squeeze the holes inode_blocks() left out of @nums; returns how many remain
+static int drop_holes(int *nums, int n)
+{
+  int x, kept = 0;
+  for (x = 0; x < n; x++)
+    if (nums[x])
+      nums[kept++] = nums[x];
+  return kept;
+}
+
+/* Replace the @del extents of file @num from extent @k on with the
+ * @nins in @ins, moving the ones after them and storing every extent
+ * that changed.  Returns 0, or -1 with nothing changed when there is
+ * no memory or no room for another indirect block.  The caller holds
+ * the inode's write lock and alloc_lock. */
+static int emap_splice(superblock *sb, inode *ino, extent_map *m, int k, int del,
+                       const extent *ins, int nins)
+{
+  extent none = { -1, 0 };
+  int n = m->n - del + nins;
+  int i;
+
+  if (emap_reserve(m, n) < 0)
+    return -1;
+  // claim any indirect blocks the longer list needs before touching it
+  for (i = m->n; i < n; i++)
+    if (ext_set(sb, ino, i, &none) < 0)
+      return -1;
+  memmove(m->ext + k + nins, m->ext + k + del, (m->n - k - del) * sizeof(extent));
+  memcpy(m->ext + k, ins, nins * sizeof(extent));
+  for (i = k; i < n; i++) {
+    m->fblock[i] = i > 0 ? m->fblock[i-1] + m->ext[i-1].len : 0;
+    ext_set(sb, ino, i, &m->ext[i]);
+  }
+  for (i = n; i < m->n; i++)
+    ext_set(sb, ino, i, &none);
+  m->n = n;
+  return 0;
+}
+
+/* Add one block to the end of file @num, growing the last extent when
+ * the block behind it is free.  Returns the new data block, or -1
+ * when the disk is full.  The caller holds the inode's write lock and
+ * alloc_lock. */
+static int inode_append(superblock *sb, int num, inode *ino)
+{
+  extent_map *m = emap_get(num, ino);
+  extent ex;
+  int db;
+
+  if (!m)
+    return -1;
+  if (m->n > 0 && m->ext[m->n-1].start != EXT_HOLE) {
+    extent *last = &m->ext[m->n-1];
+    if ((db = data_alloc_at(sb, last->start + last->len)) >= 0) {
+      last->len++;
+      m->nblocks++;
+      ext_set(sb, ino, m->n-1, last);
+      return db;
+    }
+  }
+  if ((db = data_alloc(sb)) < 0)
+    return -1;
+  ex.start = db;
+  ex.len = 1;
+  if (emap_push(m, &ex) < 0) {
+    data_free(sb, db, 1);
+    return -1;
+  }
+  if (ext_set(sb, ino, m->n-1, &ex) < 0) {
+    // no room for another indirect block
+    m->n--;
+    m->nblocks--;
+    data_free(sb, db, 1);
+    return -1;
+  }
+  return db;
+}
+
+/* Move inline file @num's contents out to a first data block, so it
+ * can grow past INODE_INLINE_MAX; an empty file gets no block, and
+ * is left with nothing mapped.  Returns 0, or -1 when the disk is
+ * full.  The caller holds the inode's write lock and alloc_lock. */
+static int inode_uninline(superblock *sb, int num, inode *ino)
+{
+  char buf[BLOCK_SIZE];
+  if (ino->size_written == 0) {
+    ino->flags &= ~INODE_INLINE;
+    return 0;
+  }
+  int db = inode_append(sb, num, ino);
+  if (db < 0)
+    return -1;
+  memset(buf, 0, BLOCK_SIZE);
+  memcpy(buf, ino->data, ino->size_written);
+  block_write(DATA_BLOCK(db), buf);
+  ino->flags &= ~INODE_INLINE;
+  memset(ino->data, 0, INODE_INLINE_MAX);
+  return 0;
+}
+
+/* Give file block @x of @num, which lies in hole extent @k, a data
+ * block: the one after the extent before it when that is free, so
+ * filling a hole front to back grows one extent, else any, splitting
+ * the hole around it.  Returns 0, or -1 when the disk is full.  The
+ * caller holds the inode's write lock and alloc_lock. */
+static int inode_fill_hole(superblock *sb, inode *ino, extent_map *m, int k, int x)
+{
+  int len = m->ext[k].len, off = x - m->fblock[k];
+  extent ins[3];
+  int nins = 0, db;
+
+  if (off == 0 && k > 0 && m->ext[k-1].start != EXT_HOLE &&
+      (db = data_alloc_at(sb, m->ext[k-1].start + m->ext[k-1].len)) >= 0) {
+    extent prev = m->ext[k-1];
+    prev.len++;
+    if (len == 1 ? emap_splice(sb, ino, m, k-1, 2, &prev, 1) < 0 :
+        ext_set(sb, ino, k-1, &prev) < 0) {
+      data_free(sb, db, 1);
+      return -1;
+    }
+    if (len > 1) {
+      m->ext[k-1] = prev;
+      m->ext[k].len--;
+      m->fblock[k]++;
+      ext_set(sb, ino, k, &m->ext[k]);
+    }
+    return 0;
+  }
+  if ((db = data_alloc(sb)) < 0)
+    return -1;
+  if (off > 0) {
+    ins[nins].start = EXT_HOLE;
+    ins[nins++].len = off;
+  }
+  ins[nins].start = db;
+  ins[nins++].len = 1;
+  if (len - off - 1 > 0) {
+    ins[nins].start = EXT_HOLE;
+    ins[nins++].len = len - off - 1;
+  }
+  if (emap_splice(sb, ino, m, k, 1, ins, nins) < 0) {
+    data_free(sb, db, 1);
+    return -1;
+  }
+  return 0;
+}
+
+/* Map file blocks @first .. @last-1 of @num for a write.  Holes in the
+ * range are filled and blocks past the end of the map appended; a
+ * write starting past the end leaves a hole behind it rather than
+ * allocating blocks nobody wrote.  Stops at the first block there is
+ * no room for and returns it, so everything from @first up to the
+ * return value is mapped.  The caller holds the inode's write lock
+ * and alloc_lock. */
+static int inode_fill(superblock *sb, int num, inode *ino, int first, int last)
+{
+  extent_map *m = emap_get(num, ino);
+  int x;
+
+  if (!m)
+    return first;
+  if (first > m->nblocks) {
+    extent *tail = m->n > 0 ? &m->ext[m->n-1] : NULL;
+    int gap = first - m->nblocks;
+    if (tail && tail->start == EXT_HOLE) {
+      tail->len += gap;
+      ext_set(sb, ino, m->n-1, tail);
+    } else {
+      extent hole = { EXT_HOLE, gap };
+      if (emap_push(m, &hole) < 0)
+        return first;
+      if (ext_set(sb, ino, m->n-1, &hole) < 0) {
+        m->n--;
+        m->nblocks -= gap;
+        return first;
+      }
+    }
+    m->nblocks = first;
+  }
+  for (x = first; x < last && x < m->nblocks; ) {
+    int k = emap_find(m, x);
+    if (m->ext[k].start != EXT_HOLE)
+      x = m->fblock[k] + m->ext[k].len;
+    else if (inode_fill_hole(sb, ino, m, k, x) < 0)
+      return x;
+    else
+      x++;
+  }
+  for (x = m->nblocks > first ? m->nblocks : first; x < last; x++)
+    if (inode_append(sb, num, ino) < 0)
+      return x;
+  return last;
+}
+
+// the largest file: file block numbers, and so the offsets a write
+// or truncate may reach, have to fit an int
+#define FILE_MAX_BYTES ((off_t)INT_MAX * BLOCK_SIZE)
+
+// file blocks a file of @ino's size needs
+#define INODE_KEEP(ino) ((int)(((ino)->size_written + BLOCK_SIZE - 1) / BLOCK_SIZE))
+
+/* Free blocks from the end of file @num, at most @max data blocks,
+ * until @keep file blocks are left; they are punched out in one batch.
+ * Holes cost nothing to drop and do not count against @max.  Returns
+ * how many are still to go, or -1 when out of memory.  The caller
+ * holds the inode's write lock and alloc_lock. */
+static int inode_trim(superblock *sb, int num, inode *ino, int keep, int max)
+{
+  extent_map *m = emap_get(num, ino);
+  extent none = { -1, 0 };
+  int n = 0, data = 0, k, x;
+  if (!m)
+    return -1;
+  for (k = m->n - 1; k >= 0 && m->nblocks - n > keep && data < max; k--) {
+    int len = m->nblocks - n - keep < m->ext[k].len ? m->nblocks - n - keep : m->ext[k].len;
+    if (m->ext[k].start != EXT_HOLE) {
+      if (len > max - data)
+        len = max - data;
+      data += len;
+    }
+    n += len;
+  }
+  if (n <= 0)
+    return 0;
+  int *nums = malloc((data + 1) * sizeof(int));
+  if (!nums)
+    return -1;
+  data = 0;
+  for (k = m->n - 1, x = n; x > 0; k--) {
+    const extent *ex = &m->ext[k];
+    int len = ex->len < x ? ex->len : x, i;
+    for (i = ex->len - len; ex->start != EXT_HOLE && i < ex->len; i++)
+      nums[data++] = DATA_BLOCK(ex->start + i);
+    x -= len;
+  }
+  block_discard(nums, data);
+  free(nums);
+
+  while (n > 0) {
+    extent *last = &m->ext[m->n-1];
+    int k = last->len < n ? last->len : n;
+    if (last->start != EXT_HOLE)
+      data_free(sb, last->start + last->len - k, k);
+    last->len -= k;
+    m->nblocks -= k;
+    n -= k;
+    if (last->len == 0) {
+      ext_set(sb, ino, m->n-1, &none);
+      m->n--;
+    } else
+      ext_set(sb, ino, m->n-1, last);
+  }
+  return m->nblocks - keep;
+}
+
+// add or drop @num in the orphan set; the caller holds alloc_lock and
+// writes @sb back
+static void orphan_set(superblock *sb, int num, int on)
+{
+  if (on)
+    bitmap_set(orphan_map, num);
+  else
+    bitmap_clear(orphan_map, num);
+  memcpy(sb->orphan_map, orphan_map, sizeof(orphan_map));
+}
+
+/* Finish a truncate of @num the reclaimer has not got to yet, so
+ * growing the file again cannot bring back its old tail.  The caller
+ * holds the inode's write lock and alloc_lock. */
+static void orphan_finish(superblock *sb, int num, inode *ino)
+{
+  if (ino->link_count > 0 && bitmap_test(orphan_map, num) &&
+      inode_trim(sb, num, ino, INODE_KEEP(ino), INT_MAX) == 0)
+    orphan_set(sb, num, 0);
+}
+
+// FNV-1a over a name, which is at most 119 characters
+static unsigned dir_hash(const char *name)
+{
+  unsigned h = 2166136261u;
+  int i;
+  for (i = 0; i < 120 && name[i]; i++)
+    h = (h ^ (unsigned char)name[i]) * 16777619u;
+  return h;
+}
+
+/* Leaf blocks.  Everything that knows how records are laid out in a
+ * leaf is in these helpers; they name a record by its byte offset. */
+
+// length of @name, which path_walk() and dir_check() cap at 119 characters
+static int dir_name_len(const char *name)
+{
+  int len = 0;
+  while (len < 120 && name[len])
+    len++;
+  return len;
+}
+
+// bytes of the leaf taken by records
+static int leaf_used(const char *node)
+{
+  int off = 0, k;
+  for (k = 0; k < ((dir_node *)node)->count; k++)
+    off += DIR_REC(node, off)->rec_len;
+  return off;
+}
+
+// offset of the first record whose hash is not below @h
+static int leaf_lower_bound(const char *node, unsigned h)
+{
+  int off = 0, k;
+  for (k = 0; k < ((dir_node *)node)->count; k++) {
+    const dir_rec *r = DIR_REC(node, off);
+    if (r->hash >= h)
+      break;
+    off += r->rec_len;
+  }
+  return off;
+}
+
+// offset of @name's record in the leaf, or -1
+static int leaf_find(const char *node, unsigned h, const char *name)
+{
+  int end = leaf_used(node);
+  int len = dir_name_len(name);
+  int off;
+  for (off = leaf_lower_bound(node, h); off < end; off += DIR_REC(node, off)->rec_len) {
+    const dir_rec *r = DIR_REC(node, off);
+    if (r->hash != h)
+      break;
+    if (r->name_len == len && memcmp(r->name, name, len) == 0)
+      return off;
+  }
+  return -1;
+}
+
+// inode number of the record at @off
+static int leaf_ino(const char *node, int off)
+{
+  return DIR_REC(node, off)->inode_num;
+}
+
+// add a record in hash order; -1 if the leaf has no room for it
+static int leaf_insert(char *node, unsigned h, const char *name, int inode_num)
+{
+  dir_node *dn = (dir_node *)node;
+  int len = dir_name_len(name);
+  int rec_len = DIR_REC_LEN(len);
+  int end = leaf_used(node);
+  if (end + rec_len > DIR_LEAF_SPACE)
+    return -1;
+  int off = leaf_lower_bound(node, h);
+  memmove(DIR_REC(node, off + rec_len), DIR_REC(node, off), end - off);
+  dir_rec *r = DIR_REC(node, off);
+  memset(r, 0, rec_len);
+  r->hash = h;
+  r->inode_num = inode_num;
+  r->rec_len = rec_len;
+  r->name_len = len;
+  memcpy(r->name, name, len);
+  dn->count++;
+  return 0;
+}
+
+static void leaf_remove(char *node, int off)
+{
+  dir_node *dn = (dir_node *)node;
+  int end = leaf_used(node);
+  int rec_len = DIR_REC(node, off)->rec_len;
+  memmove(DIR_REC(node, off), DIR_REC(node, off + rec_len), end - off - rec_len);
+  memset(DIR_REC(node, end - rec_len), 0, rec_len);
+  dn->count--;
+}
+
+/* Move the upper part of a full leaf into the empty block @nnode,
+ * splitting between two different hashes as near the middle byte as
+ * possible.  Returns the lowest hash moved, in @sep, or -1 if every
+ * record has the same hash. */
+static int leaf_split(char *node, char *nnode, unsigned *sep)
+{
+  dir_node *dn = (dir_node *)node;
+  int end = leaf_used(node);
+  int off = 0, k, mid = 0, mid_k = 0;
+  unsigned prev = 0;
+  for (k = 0; k < dn->count; k++) {
+    const dir_rec *r = DIR_REC(node, off);
+    if (k > 0 && r->hash != prev && abs(2*off - end) < abs(2*mid - end)) {
+      mid = off;
+      mid_k = k;
+    }
+    prev = r->hash;
+    off += r->rec_len;
+  }
+  if (mid_k == 0)
+    return -1;
+  memset(nnode, 0, BLOCK_SIZE);
+  ((dir_node *)nnode)->count = dn->count - mid_k;
+  memcpy(DIR_REC(nnode, 0), DIR_REC(node, mid), end - mid);
+  memset(DIR_REC(node, mid), 0, end - mid);
+  dn->count = mid_k;
+  *sep = DIR_REC(nnode, 0)->hash;
+  return 0;
+}
+
+/* Call @fn on each entry of the leaf at or after position @pos, until
+ * it returns nonzero; returns what @fn last returned. */
+static int leaf_for_each(const char *node, off_t pos, dir_walk_fn fn, void *arg)
+{
+  int end = leaf_used(node);
+  int start = leaf_lower_bound(node, DIR_POS_HASH(pos));
+  int off, rank = 0;
+  unsigned prev = 0;
+  direntry de;
+  for (off = start; off < end; off += DIR_REC(node, off)->rec_len) {
+    const dir_rec *r = DIR_REC(node, off);
+    rank = off > start && r->hash == prev ? rank + 1 : 0;
+    prev = r->hash;
+    off_t p = DIR_POS(r->hash, rank);
+    if (p < pos)
+      continue;
+    memcpy(de.name, r->name, r->name_len);
+    de.name[r->name_len] = '\0';
+    de.inode_num = r->inode_num;
+    if (fn(arg, &de, p))
+      return 1;
+  }
+  return 0;
+}
+
+/* Index blocks */
+
+// slot of the child whose subtree holds hash @h
+static int index_find(const char *node, unsigned h)
+{
+  const dir_index_entry *ie = DIR_INDEX(node);
+  int lo = 0, hi = ((dir_node *)node)->count - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (ie[mid].hash <= h)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+static int index_insert(char *node, unsigned h, int fblock)
+{
+  dir_node *dn = (dir_node *)node;
+  dir_index_entry *ie = DIR_INDEX(node);
+  if (dn->count >= DIR_INDEX_MAX)
+    return -1;
+  int k = index_find(node, h) + 1;
+  memmove(&ie[k+1], &ie[k], (dn->count - k) * sizeof(*ie));
+  ie[k].hash = h;
+  ie[k].fblock = fblock;
+  dn->count++;
+  return 0;
+}
+
+static void index_split(char *node, char *nnode, unsigned *sep)
+{
+  dir_node *dn = (dir_node *)node;
+  dir_index_entry *ie = DIR_INDEX(node);
+  int mid = dn->count / 2;
+  memset(nnode, 0, BLOCK_SIZE);
+  ((dir_node *)nnode)->level = dn->level;
+  ((dir_node *)nnode)->count = dn->count - mid;
+  memcpy(DIR_INDEX(nnode), &ie[mid], (dn->count - mid) * sizeof(*ie));
+  dn->count = mid;
+  *sep = ie[mid].hash;
+}
+
+/* Directory blocks.  The caller holds dir_lock, for writing if it
+ * changes anything. */
+
+static int dir_bmap(int dir, int fblock)
+{
+  inode ino;
+  int blk;
+  inode_get(dir, &ino);
+  extent_map *m = emap_get(dir, &ino);
+  if (!m || inode_blocks(m, fblock, 1, &blk) != 1)
+    return -1;
+  return blk;
+}
+
+static void dir_read(int dir, int fblock, char *buf)
+{
+  int blk = dir_bmap(dir, fblock);
+  if (blk < 0)
+    memset(buf, 0, BLOCK_SIZE);
+  else
+    block_read(blk, buf);
+}
+
+static void dir_write(int dir, int fblock, const char *buf)
+{
+  int blk = dir_bmap(dir, fblock);
+  if (blk >= 0)
+    block_write(blk, buf);
+}
+
+/* Add @count blocks to directory @dir, all of them or none; returns
+ * the directory block number of the first, or -1. */
+static int dir_grow(int dir, int count)
+{
+  char sb_buf[BLOCK_SIZE];
+  superblock *sb = (superblock *)sb_buf;
+  inode ino;
+  int fblock = -1, x;
+
+  pthread_mutex_lock(&alloc_lock);
+  block_read(0, sb_buf);
+  inode_get(dir, &ino);
+  extent_map *m = emap_get(dir, &ino);
+  if (m) {
+    int have = m->nblocks;
+    for (x = 0; x < count && inode_append(sb, dir, &ino) >= 0; x++)
+      ;
+    if (x == count) {
+      fblock = have;
+      ino.size_written = (int64_t)m->nblocks * BLOCK_SIZE;
+    } else
+      inode_trim(sb, dir, &ino, have, INT_MAX);
+    inode_put(dir, &ino);
+    block_write(0, sb_buf);
+  }
+  pthread_mutex_unlock(&alloc_lock);
+  return fblock;
+}
+
+/* Walk from the root to the leaf that covers hash @h, recording the
+ * directory blocks on the way in @path.  @buf is left holding the
+ * leaf.  Returns the number of blocks on the path. */
+static int dir_descend(int dir, unsigned h, int *path, char *buf)
+{
+  int n = 0, fblock = 0;
+  for (;;) {
+    path[n++] = fblock;
+    dir_read(dir, fblock, buf);
+    if (((dir_node *)buf)->level == 0 || n == DIR_MAX_DEPTH)
+      return n;
+    fblock = DIR_INDEX(buf)[index_find(buf, h)].fblock;
+  }
+}
+
+// look @name up on disk; returns its inode number, or -1
+static int dir_lookup(int dir, const char *name)
+{
+  char buf[BLOCK_SIZE];
+  int path[DIR_MAX_DEPTH];
+  unsigned h = dir_hash(name);
+  dir_descend(dir, h, path, buf);
+  int off = leaf_find(buf, h, name);
+  return off < 0 ? -1 : leaf_ino(buf, off);
+}
+
+/* Enter @name in directory @dir.  A full leaf is split, and so is
+ * any index block that then has no room for the new separator; when
+ * the root fills up it is moved down a level so the tree grows from
+ * the top.  How far the split goes is worked out, and the blocks it
+ * needs taken, before any block is written, so running out of space
+ * or depth cannot leave a new block no index points to.  Returns 0 or
+ * -ENOSPC. */
+static int dir_insert(int dir, const char *name, int inode_num)
+{
+  char buf[BLOCK_SIZE], nbuf[BLOCK_SIZE], tbuf[BLOCK_SIZE];
+  int path[DIR_MAX_DEPTH + 1];
+  unsigned h = dir_hash(name);
+  int n = dir_descend(dir, h, path, buf);
+  int i = n - 1;
+  unsigned sep, up_hash = 0;
+  int up_fblock = -1;//index entry waiting to go into path[i]
+
+  if (leaf_insert(buf, h, name, inode_num) == 0) {
+    dir_write(dir, path[i], buf);
+    return 0;
+  }
+
+  // try the leaf split on a copy, then find the first index block up
+  // the path with room for a separator; a split reaching the root adds
+  // a level
+  memcpy(tbuf, buf, BLOCK_SIZE);
+  if (leaf_split(tbuf, nbuf, &sep) < 0 ||
+      leaf_insert(h >= sep ? nbuf : tbuf, h, name, inode_num) < 0)
+    return -ENOSPC;
+  int need = 1;
+  for (i = n - 2; i >= 0; i--, need++) {
+    dir_read(dir, path[i], tbuf);
+    if (((dir_node *)tbuf)->count < DIR_INDEX_MAX)
+      break;
+  }
+  if (i < 0 && n == DIR_MAX_DEPTH)
+    return -ENOSPC;
+  int next = dir_grow(dir, i < 0 ? need + 1 : need);
+  if (next < 0)
+    return -ENOSPC;
+  i = n - 1;
+
+  for (;;) {
+    if (i == 0) {
+      // the root has to stay in block 0: copy it to a new block and
+      // make the root an index over just that block
+      int c = next++;
+      dir_write(dir, c, buf);
+      memset(nbuf, 0, BLOCK_SIZE);
+      ((dir_node *)nbuf)->level = ((dir_node *)buf)->level + 1;
+      ((dir_node *)nbuf)->count = 1;
+      DIR_INDEX(nbuf)[0].hash = 0;
+      DIR_INDEX(nbuf)[0].fblock = c;
+      dir_write(dir, 0, nbuf);
+      memmove(path + 1, path, n * sizeof(int));
+      path[1] = c;
+      n++;
+      i = 1;
+    }
+
+    if (((dir_node *)buf)->level == 0) {
+      leaf_split(buf, nbuf, &sep);
+      leaf_insert(h >= sep ? nbuf : buf, h, name, inode_num);
+    } else {
+      index_split(buf, nbuf, &sep);
+      index_insert(up_hash >= sep ? nbuf : buf, up_hash, up_fblock);
+    }
+    int f = next++;
+    dir_write(dir, path[i], buf);
+    dir_write(dir, f, nbuf);
+
+    // hand the new block up to the parent
+    up_hash = sep;
+    up_fblock = f;
+    i--;
+    dir_read(dir, path[i], buf);
+    if (index_insert(buf, up_hash, up_fblock) == 0) {
+      dir_write(dir, path[i], buf);
+      return 0;
+    }
+  }
+}
+
+// remove @name from directory @dir; returns 0 or -ENOENT
+static int dir_remove(int dir, const char *name)
+{
+  char buf[BLOCK_SIZE];
+  int path[DIR_MAX_DEPTH];
+  unsigned h = dir_hash(name);
+  int n = dir_descend(dir, h, path, buf);
+  int off = leaf_find(buf, h, name);
+  if (off < 0)
+    return -ENOENT;
+  leaf_remove(buf, off);
+  dir_write(dir, path[n-1], buf);
+  return 0;
+}
+
+/* Call @fn on the entries below directory block @fblock in hash
+ * order, starting at position @pos, until it returns nonzero.
+ * Subtrees wholly before @pos are not read.  Returns nonzero if @fn
+ * stopped the walk. */
+static int dir_walk(int dir, int fblock, off_t pos, dir_walk_fn fn, void *arg)
+{
+  char buf[BLOCK_SIZE];
+  int k;
+  if (pos < DIR_POS(0, 0))
+    pos = DIR_POS(0, 0);
+  dir_read(dir, fblock, buf);
+  if (((dir_node *)buf)->level == 0)
+    return leaf_for_each(buf, pos, fn, arg);
+  for (k = index_find(buf, DIR_POS_HASH(pos)); k < ((dir_node *)buf)->count; k++)
+    if (dir_walk(dir, DIR_INDEX(buf)[k].fblock, pos, fn, arg))
+      return 1;
+  return 0;
+}
+
+/* The dentry cache maps (parent directory, name) to the child inode,
+ * so walking a path costs a hash lookup per component instead of a
+ * descent through each directory's tree.  An inode has exactly one
+ * name, so the entries are kept per inode and chained by inode
+ * number; a slot with parent -1 is not cached.  Names change only
+ * under a write lock of dir_lock; misses are filled from disk by
+ * dir_child under a shared one, holding dcache_lock.  Nothing is
+ * evicted: the cache never holds more entries than there are inodes. */
+#define DCACHE_SIZE 128
+
+typedef struct dentry_struct{
+  int parent;//directory holding the name, -1 if not cached
+  int type;//the child's inode type
+  char name[120];
+  int next;//next inode in the hash chain, -1 at the end
+}dentry;
+
+static dentry dcache[SFS_NUM_INODES];
+static int dcache_buckets[DCACHE_SIZE];
+
+static unsigned dcache_hash(int parent, const char *name)
+{
+  return (dir_hash(name) ^ (unsigned)parent * 2654435761u) & (DCACHE_SIZE - 1);
+}
+
+/* Negative entries: names known not to exist, so probes for missing
+ * files skip the descent through the directory's tree.  The table is
+ * direct-mapped and a new entry simply replaces whatever was in its
+ * slot, which bounds it at NEG_SLOTS names.  Entering a name drops
+ * its negative entry, and freeing a directory drops all of its. */
+#define NEG_SLOTS 256
+
+typedef struct neg_dentry_struct{
+  int parent;//-1 if the slot is empty
+  char name[120];
+}neg_dentry;
+
+static neg_dentry neg_cache[NEG_SLOTS];
+
+static neg_dentry *neg_slot(int parent, const char *name)
+{
+  return &neg_cache[(dir_hash(name) ^ (unsigned)parent * 2654435761u) & (NEG_SLOTS - 1)];
+}
+
+static int neg_lookup(int parent, const char *name)
+{
+  neg_dentry *n = neg_slot(parent, name);
+  return n->parent == parent && strncmp(n->name, name, 120) == 0;
+}
+
+static void neg_add(int parent, const char *name)
+{
+  neg_dentry *n = neg_slot(parent, name);
+  n->parent = parent;
+  strncpy(n->name, name, 120);
+}
+
+static void neg_remove(int parent, const char *name)
+{
+  neg_dentry *n = neg_slot(parent, name);
+  if (n->parent == parent && strncmp(n->name, name, 120) == 0)
+    n->parent = -1;
+}
+
+// forget every negative entry in directory @parent
+static void neg_purge(int parent)
+{
+  int k;
+  for (k = 0; k < NEG_SLOTS; k++)
+    if (neg_cache[k].parent == parent)
+      neg_cache[k].parent = -1;
+}
+
+// the child of @parent called @name, or -1 if it is not cached
+static int dcache_lookup(int parent, const char *name)
+{
+  int k;
+  for (k = dcache_buckets[dcache_hash(parent, name)]; k != -1; k = dcache[k].next)
+    if (dcache[k].parent == parent && strncmp(dcache[k].name, name, 120) == 0)
+      return k;
+  return -1;
+}
+
+static void dcache_add(int parent, const char *name, int inode_num, int type)
+{
+  unsigned h = dcache_hash(parent, name);
+  dentry *d = &dcache[inode_num];
+  neg_remove(parent, name);
+  d->parent = parent;
+  d->type = type;
+  strncpy(d->name, name, 120);
+  d->next = dcache_buckets[h];
+  dcache_buckets[h] = inode_num;
+}
+
+static void dcache_remove(int inode_num)
+{
+  dentry *d = &dcache[inode_num];
+  if (d->parent == -1)
+    return;
+  int *p = &dcache_buckets[dcache_hash(d->parent, d->name)];
+  while (*p != inode_num)
+    p = &dcache[*p].next;
+  *p = d->next;
+  d->parent = -1;
+}
+
+static void dcache_init(void)
+{
+  int k;
+  for (k = 0; k < DCACHE_SIZE; k++)
+    dcache_buckets[k] = -1;
+  for (k = 0; k < SFS_NUM_INODES; k++)
+    dcache[k].parent = -1;
+  for (k = 0; k < NEG_SLOTS; k++)
+    neg_cache[k].parent = -1;
+}
+
+/* Look @name up in directory @dir, through the dentry cache and the
+ * negative entries.  Returns the child's inode number and sets *@type,
+ * or returns -1.  The caller holds dir_lock, shared is enough. */
+static int dir_child(int dir, const char *name, int *type)
+{
+  pthread_mutex_lock(&dcache_lock);
+  int num = dcache_lookup(dir, name);
+  int neg = num == -1 && neg_lookup(dir, name);
+  if (num != -1)
+    *type = dcache[num].type;
+  pthread_mutex_unlock(&dcache_lock);
+  if (num != -1 || neg)
+    return num;
+
+  num = dir_lookup(dir, name);
+  if (num == -1) {
+    pthread_mutex_lock(&dcache_lock);
+    neg_add(dir, name);
+    pthread_mutex_unlock(&dcache_lock);
+    return -1;
+  }
+  inode ino;
+  inode_get(num, &ino);
+  *type = ino.type;
+  pthread_mutex_lock(&dcache_lock);
+  if (dcache[num].parent == -1)
+    dcache_add(dir, name, num, ino.type);
+  pthread_mutex_unlock(&dcache_lock);
+  return num;
+}
+
+/* What the mount scan has found: the inodes a name leads to, the
+ * directories still to walk, and the names in the current directory
+ * leading to an inode already unlinked or freed, removed once the
+ * walk of it is over. */
+struct scan_arg {
+  char *named;
+  int *dirs, ndirs;
+  direntry *stale;
+  int nstale, max;
+};
+
+static int scan_fn(void *arg, const direntry *de, off_t pos)
+{
+  struct scan_arg *sa = arg;
+  int num = de->inode_num;
+  inode ino;
+
+  if (num >= 0 && num < SFS_NUM_INODES && bitmap_test(inode_map, num)) {
+    inode_get(num, &ino);
+    if (ino.type != 0 && ino.link_count > 0 && !sa->named[num]) {
+      sa->named[num] = 1;
+      if (ino.type == TYPE_DIR)
+        sa->dirs[sa->ndirs++] = num;
+      return 0;
+    }
+  }
+  if (sa->nstale == sa->max) {
+    direntry *d = realloc(sa->stale, (sa->max * 2 + 8) * sizeof(direntry));
+    if (!d)
+      return 0;
+    sa->stale = d;
+    sa->max = sa->max * 2 + 8;
+  }
+  sa->stale[sa->nstale++] = *de;
+  return 0;
+}
+
+/* After a crash the orphan set on disk cannot be trusted: a direntry,
+ * an inode and block 0 are written back independently, so an unlink
+ * or truncate may have reached the disk only in part.  Walk the tree
+ * from the root, drop the names that lead to unlinked or free inodes,
+ * and make an orphan of every inode no name leads to and of every
+ * file holding blocks past its end, for the reclaimer to finish.
+ * Runs at mount, before any other thread. */
+static void mount_scan(superblock *sb)
+{
+  char named[SFS_NUM_INODES] = { 0 };
+  int dirs[SFS_NUM_INODES];
+  struct scan_arg sa = { named, dirs, 0, NULL, 0, 0 };
+  int num, k, orphans = 0, stale = 0;
+  inode ino;
+
+  named[ROOT_INO] = 1;
+  dirs[sa.ndirs++] = ROOT_INO;
+  while (sa.ndirs > 0) {
+    int dir = dirs[--sa.ndirs];
+    sa.nstale = 0;
+    dir_walk(dir, 0, 0, scan_fn, &sa);
+    for (k = 0; k < sa.nstale; k++)
+      dir_remove(dir, sa.stale[k].name);
+    stale += sa.nstale;
+  }
+  free(sa.stale);
+
+  pthread_mutex_lock(&alloc_lock);
+  for (num = 0; num < SFS_NUM_INODES; num++) {
+    if (!bitmap_test(inode_map, num) || bitmap_test(orphan_map, num))
+      continue;
+    inode_get(num, &ino);
+    if (!named[num]) {
+      if (ino.link_count != 0) {
+        ino.link_count = 0;
+        inode_put(num, &ino);
+      }
+    } else {
+      extent_map *m = ino.type == TYPE_FILE && !(ino.flags & INODE_INLINE) ?
+        emap_get(num, &ino) : NULL;
+      if (!m || m->nblocks <= INODE_KEEP(&ino))
+        continue;
+    }
+    orphan_set(sb, num, 1);
+    orphans++;
+  }
+  pthread_mutex_unlock(&alloc_lock);
+  log_msg("mount_scan: %d stale names removed, %d orphans found\n", stale, orphans);
+}
 
 void *sfs_init(struct fuse_conn_info *conn)
 {
@@ -90,66 +1580,56 @@ void *sfs_init(struct fuse_conn_info *conn)
   //log_conn(conn);
   //log_fuse_context(fuse_get_context());
   //log_msg("about to open disk (testfsfile)\n");
-  disk_open(SFS_DATA->diskfile);
-
-  //setting up the superblock struct in block 0 below
-  char buf[512];
-  memset(buf, '\0', 512);
-  superblock sb;
-  memset(sb.sfsname, '\0', sizeof(sb.sfsname));
-  char src[] = "poop";
-  strncpy(sb.sfsname, src, sizeof(src));
-  sb.num_inodes = 100;
-  sb.num_datablocks = 1100;
-  sb.total_num_inodes = 100;
-  sb.total_num_datablocks = 1100;
-
-  //filling in the char map (instead of bit map) for inode and data blocks below 
   int i;
-  for(i = 0; i < 100; i++){
-    sb.inode_map[i] = 0;
-  }
-  block_write(0, &sb);
-
-  // CREATING AND FILLING IN THE DATA CHAR MAPS, BLOCKS 1-3, (3 total)
-  char data_map[367];
-  memset(data_map, 0, 367);
-  for(i = 1; i <= 3; i++){
-    // set this to something unusable (not 0 or 1), since there should only be 1100 data blocks, not 1101
-    if(i == 3){
-      data_map[366] = 'a';
-    }
-    block_write(i, data_map);
-  }
-
-  memset(buf, 0, 512);
-
-  // CREATING INODE ARRAY STRUCTS, BLOCKS 4-23 (20 total)
-  inode_array x;
-  int ii;
-  for(i = 4; i <= 23; i++){
-    for(ii = 0; ii < 5; ii++){
-      x.i[ii].type = 0;
-      x.i[ii].link_count = 0;
-      x.i[ii].size_written = 0;
-      x.i[ii].mode = 0;
-      int d;
-      for(d = 0; d <= 11; d++){
-        x.i[ii].db[d] = -1;
-      }
-    }
-    block_write(i, &x);
+  for(i = 0; i < SFS_NUM_INODES; i++){
+    pthread_rwlock_init(&inode_locks[i], NULL);
   }
 
-  //writing in direntry array structs in blocks 24 - 48 (25 total)
-  direntry_array y;
-  for(i = 24; i <= 48; i++){
-    for(ii = 0; ii < 4; ii++){
-      memset(y.d[ii].name, '\0', sizeof(y.d[ii].name));
-      y.d[ii].inode_num = -1;//this is the block num for testing 
-    }
-    block_write(i, &y);
+  // main checked the superblock already; it holds everything a mount
+  // needs, the rest is read as it is used
+  superblock sbk;
+  if (sfs_super_read(SFS_DATA->diskfile, &sbk) < 0)
+    exit(EXIT_FAILURE);
+  geo = sbk.geo;
+  block_set_size(geo.block_size);
+  block_cache_init((size_t)SFS_DATA->cache_kb * 1024);
+  if (SFS_DATA->engine && strcmp(SFS_DATA->engine, "uring") == 0)
+    block_set_engine(BLOCK_ENGINE_URING);
+  if (SFS_DATA->use_mmap)
+    block_set_mmap(geo.data_start + SFS_NUM_DATABLOCKS);
+  disk_open(SFS_DATA->diskfile);
+  log_msg("sfs_init: block engine %s, block size %d, data starts at block %d\n",
+      block_engine() == BLOCK_ENGINE_URING ? "uring" : "sync", geo.block_size, geo.data_start);
+
+  char buf[BLOCK_SIZE];
+  superblock *sb = (superblock *)buf;
+  block_read(0, buf);
+  memcpy(inode_map, sb->inode_map, sizeof(inode_map));
+  memcpy(orphan_map, sb->orphan_map, sizeof(orphan_map));
+  free(data_map);
+  data_map = malloc((size_t)geo.data_map_blocks*BLOCK_SIZE);
+  for(i = 0; i < geo.data_map_blocks; i++){
+    block_read(geo.data_map_start + i, (char *)data_map + (size_t)i*BLOCK_SIZE);
+  }
+  inode_cursor = data_cursor = 0;
+  icache_reset();
+
+  // cleared until sfs_destroy, so the next mount knows if it never ran
+  if(!sb->clean){
+    fprintf(stderr, "sfs: %s was not cleanly unmounted\n", SFS_DATA->diskfile);
+    log_msg("sfs_init: %s was not cleanly unmounted\n", SFS_DATA->diskfile);
+    mount_scan(sb);
   }
+  sb->clean = 0;
+  block_write(0, buf);
+  block_sync();
+  log_msg("sfs_init: %d of %d inodes and %d of %d data blocks free, %d orphans\n",
+      sb->num_inodes, SFS_NUM_INODES, sb->num_datablocks, SFS_NUM_DATABLOCKS,
+      bitmap_weight(orphan_map, SFS_NUM_INODES));
+
+  dcache_init();
+  writeback_start();
+  reclaim_start();
 
   return SFS_DATA;
 }
@@ -165,20 +1645,37 @@ void *sfs_init(struct fuse_conn_info *conn)
 void sfs_destroy(void *userdata)
 {
     log_msg("about to close disk\n");  
-    int i, j;
-    char data_map_buf[512];
-    for(i = 1; i<=3; i++){
-      block_read(i, data_map_buf);
-      for(j = 0; j<367; j++){
-        if(data_map_buf[j] == 1){
-          char data_block_buf[512];
-          block_read(j+49, data_block_buf);
-          memset(data_block_buf, '\0', 512);
-          block_write(j+49, data_block_buf);
-        }
-      }
-    }
+    int i;
+    reclaim_stop();
+    writeback_stop();
+    int lost = inode_flush() < 0;
+    log_msg("%d of %d data blocks in use\n", bitmap_weight(data_map, SFS_NUM_DATABLOCKS), SFS_NUM_DATABLOCKS);
+
+    // everything is on the disk now; mark it so for the next mount,
+    // unless some inodes never made it there
+    char sb_buf[BLOCK_SIZE];
+    block_read(0, sb_buf);
+    if (lost)
+      log_msg("sfs_destroy: inodes could not be written, leaving the disk unclean\n");
+    else
+      ((superblock *)sb_buf)->clean = 1;
+    block_write(0, sb_buf);
+    block_sync();
     disk_close();
+    free(data_map);
+    data_map = NULL;
+    for(i = 0; i < SFS_NUM_INODES; i++){
+      emap_drop(i);
+    }
+
+    struct block_stats st;
+    block_get_stats(&st);
+    log_msg("read-ahead: %lu blocks prefetched, %lu hits, %lu wasted\n",
+        st.prefetched, st.prefetch_hits, st.prefetch_wasted);
+    log_msg("inode writeback: %lu batches, %lu inode blocks\n",
+        icache_batches, icache_blocks);
+    log_msg("reclaimer: %lu batches, %lu blocks freed, %d orphans left\n",
+        reclaim_batches, reclaim_freed, bitmap_weight(orphan_map, SFS_NUM_INODES));
     log_msg("\nsfs_destroy(userdata=0x%08x)\n", userdata);
 }
 
@@ -191,34 +1688,102 @@ static void sfs_fullpath(char fpath[PATH_MAX], const char *path)
   log_msg(" sfs_fullpath:  rootdir = \"%s\", path = \"%s\", fpath = \"%s\"\n", SFS_DATA->diskfile, path, fpath);
 }
 
-int * find_direntry ( const char * path, int * array)
+/* Walk @len bytes of @path from the root, one component at a time.
+ * Returns the inode number and sets *@type, or -ENOENT, -ENOTDIR or
+ * -ENAMETOOLONG.  The caller holds dir_lock. */
+static int path_walk(const char *path, size_t len, int *type)
 {
+  const char *p = path, *end = path + len;
+  char name[120];
+  int num = ROOT_INO;
+
+  *type = TYPE_DIR;
+  for (;;) {
+    while (p < end && *p == '/')
+      p++;
+    if (p == end)
+      return num;
+    const char *q = p;
+    while (q < end && *q != '/')
+      q++;
+    if (q - p >= 120)
+      return -ENAMETOOLONG;
+    if (*type != TYPE_DIR)
+      return -ENOTDIR;
+    memcpy(name, p, q - p);
+    name[q - p] = '\0';
+    num = dir_child(num, name, type);
+    if (num == -1)
+      return -ENOENT;
+    p = q;
+  }
+}
+
+/* Split @path into its directory and last component.  Returns the
+ * directory's inode number with the component copied to @name, or
+ * -ENOENT, -ENOTDIR, -ENAMETOOLONG, or -EEXIST for the root itself.
+ * The caller holds dir_lock. */
+static int path_parent(const char *path, char name[120])
+{
+  size_t len = strlen(path);
+  int type;
+
+  while (len > 0 && path[len-1] == '/')
+    len--;
+  size_t start = len;
+  while (start > 0 && path[start-1] != '/')
+    start--;
+  if (start == len)
+    return -EEXIST;
+  if (len - start >= 120)
+    return -ENAMETOOLONG;
+  int dir = path_walk(path, start, &type);
+  if (dir < 0)
+    return dir;
+  if (type != TYPE_DIR)
+    return -ENOTDIR;
+  memcpy(name, path + start, len - start);
+  name[len - start] = '\0';
+  return dir;
+}
+
+/* Look @path up.  Returns its inode number, or -1 if there is no
+ * such file.  The caller holds dir_lock. */
+int find_direntry(const char *path)
+{
+  int type;
   log_msg("\nfind_direntry( path=\"%s\")\n", path);
 
-  int * copy = malloc( sizeof( int ) * 3);
-  char buff[512];
-  int i, j;
-
-  for(i = 24; i < 49; i++) {
-    block_read(i, buff);
-    //iterating through direntry_array within block j (j between 24 - 48 inclusive)
-    direntry_array *pde = (direntry_array *)buff;
-    for(j = 0; j < 4; j++) {
-      //log_msg("find_dirent LINE %d: direntry contents: name=%s, inode_num=%d\n",__LINE__, pde->d[j].name, pde->d[j].inode_num);
-      if(strcmp(path, pde->d[j].name) == 0){
-        log_msg("find_direntry LINE %d DIRENTRY FOUND, returning inode_num = %d\n",__LINE__, pde->d[j].inode_num);
-        copy[0] = pde->d[j].inode_num;
-        copy[1] = i;
-        copy[2] = j;
-        return copy;
-      }
-    }
+  int num = path_walk(path, strlen(path), &type);
+  log_msg("find_direntry LINE %d returning %d\n",__LINE__, num);
+  return num < 0 ? -1 : num;
+}
+
+/* Look @path up and lock its inode, for writing if @excl is set.
+ * Returns the inode number, or -ENOENT with nothing locked; -EBADF
+ * when there is no path at all, as fuse sends for an open file once
+ * flag_nopath is set. */
+static int sfs_lookup_lock(const char *path, int excl)
+{
+  if (path == NULL)
+    return -EBADF;
+  pthread_rwlock_rdlock(&dir_lock);
+  int inode_num = find_direntry(path);
+  if (inode_num == -1) {
+    inode_num = -ENOENT;
+  } else {
+    if (excl)
+      pthread_rwlock_wrlock(&inode_locks[inode_num]);
+    else
+      pthread_rwlock_rdlock(&inode_locks[inode_num]);
   }
-  log_msg("find_direntry LINE %d DIRENTRY NOT FOUND, returning -1\n",__LINE__);
-  copy[0] = -1;
-  copy[1] = i;
-  copy[2] = j;
-  return copy; 
+  pthread_rwlock_unlock(&dir_lock);
+  return inode_num;
+}
+
+static void inode_unlock(int inode_num)
+{
+  pthread_rwlock_unlock(&inode_locks[inode_num]);
 }
 
 /* Get file attributes.
@@ -228,6 +1793,26 @@ int * find_direntry ( const char * path, int * array)
  * mount option is given.
  */
 
+// fill @statbuf for inode @num
+static void inode_stat(int num, struct stat *statbuf)
+{
+  inode attr_inode;
+  inode_get(num, &attr_inode);
+  memset(statbuf, 0, sizeof(struct stat));
+  statbuf->st_ino = num;
+  if (attr_inode.type == TYPE_DIR) {
+    statbuf->st_mode = S_IFDIR | 0777;
+    statbuf->st_nlink = 2;
+  } else {
+    statbuf->st_mode = S_IFREG | 0777;
+    statbuf->st_nlink = 1;
+  }
+  statbuf->st_size = attr_inode.size_written;
+//  statbuf->st_blocks = 2;
+  statbuf->st_mtime = time(NULL);
+  statbuf->st_ctime = time(NULL);
+}
+
 int sfs_getattr(const char *path, struct stat *statbuf)
 {
   int retstat = 0;
@@ -235,50 +1820,494 @@ int sfs_getattr(const char *path, struct stat *statbuf)
   log_msg("\nsfs_getattr(path=\"%s\", statbuf=0x%08x)\n", path, statbuf);
   memset(statbuf, 0, sizeof(struct stat));
 
-  int array[3];
-  int * array_ptr;
-  inode attr_inode; 
+  int inode_num;
 
-  if (strcmp(path, "/") == 0) 
-  {
-    log_msg("sfs_getattr LINE %d: root directory",__LINE__);
-    statbuf->st_mode = S_IFDIR | 0777;
-    statbuf->st_nlink = 2;
-    statbuf->st_mtime = time(NULL);
-    statbuf->st_ctime = time(NULL);
-    log_stat(statbuf);
-    //I believe we don't have to free here beccause array_ptr was never malloced;
-    return retstat;
-  } else if ((array_ptr = find_direntry(path, array))[0] != -1) 
+  if ((inode_num = sfs_lookup_lock(path, 0)) >= 0) 
   {
-    //log_msg("sfs_getattr LINE %d: direntry contents: name=%s, inode_num=%d\n", __LINE__, pde->d[i].name, pde->d[i].inode_num);
-    int inode_num = array_ptr[0];
-    int inode_block = inode_num/5 + 4;
-    int inode_block_index = inode_num%5;
-    char inode_buf[512];
-    block_read(inode_block, inode_buf);
-    inode_array *inode_arr = (inode_array *)inode_buf;
-    log_msg("I am a file called=>  path=\"%s\")\n", path);
-    
-    statbuf->st_mode = S_IFREG | 0777;
-    statbuf->st_nlink = 1;
-    statbuf->st_size = inode_arr->i[inode_block_index].size_written;
-  //  statbuf->st_blocks = 2;
-    statbuf->st_mtime = time(NULL);
-    statbuf->st_ctime = time(NULL);
+    inode_stat(inode_num, statbuf);
+    inode_unlock(inode_num);
+    log_msg("sfs_getattr LINE %d: path=\"%s\" is inode %d\n",__LINE__, path, inode_num);
     log_stat(statbuf);
-    free(array_ptr);
     return retstat;
   } else 
   {
     log_msg("sfs_getattr LINE %d: DIRENTRY not found, returning -ENOENT",__LINE__ );
     retstat = -ENOENT;
     log_stat(statbuf);
-    free(array_ptr);
     return retstat;
   }
 }
 
+/* Allocate an inode of @type with its first data block; a directory's
+ * block is its empty root leaf.  Returns the inode number, or -ENOSPC.
+ * The inode is not in any directory yet. */
+static int inode_alloc(int type, int mode)
+{
+  char sb_b[BLOCK_SIZE];
+  superblock *sb_buf = (superblock *)sb_b;
+  int free_inode = -1;
+
+  //time to go through the inode map to find the next free inode
+  pthread_mutex_lock(&alloc_lock);
+  block_read(0, sb_b);
+  log_msg("inode_alloc LINE %d: num free inodes: %d\n",__LINE__, sb_buf->num_inodes);
+  if(sb_buf->num_inodes > 0)
+    free_inode = bitmap_alloc(inode_map, SFS_NUM_INODES, &inode_cursor);
+  if(free_inode < 0){
+    log_msg("inode_alloc LINE %d: ERROR: NO FREE INODES\n",__LINE__);
+    pthread_mutex_unlock(&alloc_lock);
+    return -ENOSPC;
+  }
+
+  //and the data map for a directory's first block; a file starts
+  //out inline and needs none
+  int datablock_num = -1;
+  if(type == TYPE_DIR && (datablock_num = data_alloc(sb_buf)) < 0){
+    bitmap_clear(inode_map, free_inode);
+    pthread_mutex_unlock(&alloc_lock);
+    return -ENOSPC;
+  }
+  sb_buf->num_inodes--;
+  memcpy(sb_buf->inode_map, inode_map, sizeof(inode_map));
+  block_write(0, sb_b);
+  pthread_mutex_unlock(&alloc_lock);
+  log_msg("inode_alloc LINE %d: inode %d, datablock %d\n",__LINE__, free_inode, datablock_num);
+
+  inode new_inode;
+  inode_get(free_inode, &new_inode);
+  new_inode.type = type;
+  new_inode.mode = mode;
+  new_inode.link_count = type == TYPE_DIR ? 2 : 1;
+  new_inode.flags = type == TYPE_DIR ? 0 : INODE_INLINE;
+  if(datablock_num >= 0){
+    new_inode.ext[0].start = datablock_num;
+    new_inode.ext[0].len = 1;
+  }
+  if(type == TYPE_DIR){
+    char buf[BLOCK_SIZE];
+    memset(buf, 0, BLOCK_SIZE);
+    block_write(DATA_BLOCK(datablock_num), buf);
+    new_inode.size_written = BLOCK_SIZE;
+  }
+  inode_put(free_inode, &new_inode);
+  return free_inode;
+}
+
+/* Free inode @num and all its blocks once nobody is using it, taking
+ * it out of the orphan set.  The caller holds dir_lock for writing and
+ * has removed its direntry. */
+static void inode_release(int num)
+{
+  // wait for anyone still reading or writing it
+  pthread_rwlock_wrlock(&inode_locks[num]);
+
+  //change superblock
+  pthread_mutex_lock(&alloc_lock);
+  char sb_buf[BLOCK_SIZE];
+  block_read(0, sb_buf);
+  superblock *sb = (superblock *)sb_buf;
+  sb->num_inodes++;
+  bitmap_clear(inode_map, num);
+  memcpy(sb->inode_map, inode_map, sizeof(inode_map));
+  orphan_set(sb, num, 0);
+  log_msg("inode_release LINE %d: CHANGED inode map at index: %d\n",__LINE__, num);
+
+  //change inode
+  inode curr_inode;
+  inode_get(num, &curr_inode);
+  log_msg("inode found at block %d index %d\n", INODE_BLOCK(num), INODE_INDEX(num));
+
+  // hand what the reclaimer left back to the host, a hole per extent
+  // and all in one batch, before anyone else can allocate them
+  extent_map *m = emap_get(num, &curr_inode);
+  int nfreed = 0, x, i;
+  for(x = 0; m && x < m->n; x++)
+    if (m->ext[x].start != EXT_HOLE)
+      nfreed += m->ext[x].len;
+  int *freed = malloc((nfreed + 1) * sizeof(int));
+  if (freed)
+  {
+    nfreed = 0;
+    for(x = 0; m && x < m->n; x++)
+      for(i = 0; m->ext[x].start != EXT_HOLE && i < m->ext[x].len; i++)
+        freed[nfreed++] = DATA_BLOCK(m->ext[x].start + i);
+    block_discard(freed, nfreed);
+    free(freed);
+  }
+
+  for(x = 0; m && x < m->n; x++)
+  {
+    log_msg("inode_release LINE %d: freeing extent %d: %d blocks from %d\n",__LINE__, x, m->ext[x].len, m->ext[x].start);
+    // change data map bits, which also increments available datablocks
+    if (m->ext[x].start != EXT_HOLE)
+      data_free(sb, m->ext[x].start, m->ext[x].len);
+  }
+  // the indirect blocks too, in a second batch, sorted: the walk
+  // meets a block's children before it
+  int nind = 0, cap = 0;
+  int *ind = NULL;
+  for(x = 0; x < 3; x++)
+  {
+    if (curr_inode.indirect[x])
+      ind_free(sb, curr_inode.indirect[x], x, &ind, &nind, &cap);
+    curr_inode.indirect[x] = 0;
+  }
+  if (nind > 0)
+    qsort(ind, nind, sizeof(int), cmp_int);
+  block_discard(ind, nind);
+  free(ind);
+  for(x = 0; x < INODE_EXTENTS; x++)
+  {
+    curr_inode.ext[x].start = -1;
+    curr_inode.ext[x].len = 0;
+  }
+  if (curr_inode.type == TYPE_DIR)
+    neg_purge(num);
+  curr_inode.type = 0;
+  curr_inode.size_written = 0;
+  curr_inode.flags = 0;
+  memset(curr_inode.data, 0, INODE_INLINE_MAX);
+  emap_drop(num);
+  block_write(0,sb_buf);
+  pthread_mutex_unlock(&alloc_lock);
+
+  inode_put(num, &curr_inode);
+  inode_unlock(num);
+}
+
+/* Open files, and with the low-level front end the kernel's lookups,
+ * hold references on their inode, so an inode unlinked while it is
+ * referenced keeps its blocks until the last reference goes.  The
+ * counts go up under a shared dir_lock, hence the atomics. */
+static long inode_refs[SFS_NUM_INODES];
+
+// take @n references on inode @num; the caller holds dir_lock
+static void inode_ref(int num, long n)
+{
+  __atomic_add_fetch(&inode_refs[num], n, __ATOMIC_RELAXED);
+}
+
+/* Whether @num is still an unlinked orphan nobody references, and so
+ * can be freed.  Between dropping the inode lock and taking dir_lock
+ * someone else may have freed it, and a create reused it.  Nothing can
+ * take a reference to an unlinked inode without dir_lock, so with it
+ * held for writing the answer is final. */
+static int orphan_dead(int num)
+{
+  inode ino;
+  int on;
+
+  pthread_mutex_lock(&alloc_lock);
+  on = bitmap_test(orphan_map, num);
+  pthread_mutex_unlock(&alloc_lock);
+  if (!on || __atomic_load_n(&inode_refs[num], __ATOMIC_RELAXED) != 0)
+    return 0;
+  inode_get(num, &ino);
+  return ino.link_count == 0;
+}
+
+/* How reclaim_step() is called: from a thread already holding other
+ * locks, which must not wait for a busy inode and cannot free one, or
+ * with dir_lock held for writing, which can free one directly. */
+#define RECLAIM_SYNC        1
+#define RECLAIM_DIR_LOCKED  2
+
+/* One reclaimer batch of orphan @num.  An unlinked inode that is
+ * still referenced is left for later, and one with no blocks left is
+ * freed.  Returns the blocks it has left, or -1 if nothing was done. */
+static int reclaim_step(int num, int how)
+{
+  char sb_buf[BLOCK_SIZE];
+  superblock *sb = (superblock *)sb_buf;
+  inode ino;
+  int left = -1;
+
+  if (how & RECLAIM_SYNC) {
+    if (pthread_rwlock_trywrlock(&inode_locks[num]) != 0)
+      return -1;
+  } else
+    pthread_rwlock_wrlock(&inode_locks[num]);
+  pthread_mutex_lock(&alloc_lock);
+  inode_get(num, &ino);
+  if (bitmap_test(orphan_map, num) &&
+      (ino.link_count > 0 || __atomic_load_n(&inode_refs[num], __ATOMIC_RELAXED) == 0)) {
+    extent_map *m = emap_get(num, &ino);
+    int before = m ? m->nblocks : 0;
+    block_read(0, sb_buf);
+    left = inode_trim(sb, num, &ino, ino.link_count > 0 ? INODE_KEEP(&ino) : 0, RECLAIM_BATCH);
+    if (m)
+      reclaim_freed += before - m->nblocks;
+    if (left == 0 && ino.link_count > 0)
+      orphan_set(sb, num, 0);
+    inode_put(num, &ino);
+    block_write(0, sb_buf);
+    reclaim_batches++;
+  }
+  pthread_mutex_unlock(&alloc_lock);
+  inode_unlock(num);
+
+  if (left == 0 && ino.link_count == 0) {
+    if (how & RECLAIM_DIR_LOCKED) {
+      if (orphan_dead(num))
+        inode_release(num);
+    } else if (how & RECLAIM_SYNC) {
+      reclaim_kick();
+    } else {
+      pthread_rwlock_wrlock(&dir_lock);
+      if (orphan_dead(num))
+        inode_release(num);
+      pthread_rwlock_unlock(&dir_lock);
+    }
+  }
+  return left;
+}
+
+/* Free every orphan now, rather than wait for the reclaimer, when an
+ * allocation has run out; the reclaimer can fall well behind a busy
+ * machine.  @how is as for reclaim_step().  Returns nonzero if any
+ * orphan was there to work on. */
+static int reclaim_sync(int how)
+{
+  uint64_t todo[BITMAP_WORDS(SFS_NUM_INODES)];
+  int num, any = 0;
+
+  pthread_mutex_lock(&alloc_lock);
+  memcpy(todo, orphan_map, sizeof(todo));
+  pthread_mutex_unlock(&alloc_lock);
+  for (num = 0; num < SFS_NUM_INODES; num++) {
+    if (!bitmap_test(todo, num))
+      continue;
+    int left;
+    while ((left = reclaim_step(num, how)) > 0)
+      ;
+    any |= left == 0;
+  }
+  return any;
+}
+
+static int reclaim_stopping(void)
+{
+  pthread_mutex_lock(&reclaim_lock);
+  int stop = !reclaim_running;
+  pthread_mutex_unlock(&reclaim_lock);
+  return stop;
+}
+
+static void *reclaim_main(void *arg)
+{
+  uint64_t todo[BITMAP_WORDS(SFS_NUM_INODES)];
+  int num, busy;
+
+  pthread_mutex_lock(&reclaim_lock);
+  while (reclaim_running) {
+    if (!reclaim_pending) {
+      pthread_cond_wait(&reclaim_cond, &reclaim_lock);
+      continue;
+    }
+    reclaim_pending = 0;
+    pthread_mutex_unlock(&reclaim_lock);
+    // a batch from each orphan in turn, until a pass finds nothing to do
+    do {
+      busy = 0;
+      pthread_mutex_lock(&alloc_lock);
+      memcpy(todo, orphan_map, sizeof(todo));
+      pthread_mutex_unlock(&alloc_lock);
+      for (num = 0; num < SFS_NUM_INODES && !reclaim_stopping(); num++)
+        if (bitmap_test(todo, num))
+          busy |= reclaim_step(num, 0) >= 0;
+    } while (busy && !reclaim_stopping());
+    pthread_mutex_lock(&reclaim_lock);
+  }
+  pthread_mutex_unlock(&reclaim_lock);
+  return NULL;
+}
+
+// drop @n references on inode @num; if it was unlinked, the reclaimer
+// frees it once the last is gone
+static void inode_unref(int num, long n)
+{
+  if (__atomic_sub_fetch(&inode_refs[num], n, __ATOMIC_RELAXED) == 0)
+    reclaim_kick();
+}
+
+/* Hang a new sfs_file for inode @num off @fi, unless it already has
+ * one.  The caller holds dir_lock. */
+static int sfs_file_open(struct fuse_file_info *fi, int num)
+{
+  if (fi == NULL || fi->fh != 0)
+    return 0;
+  sfs_file *f = calloc(1, sizeof(sfs_file));
+  if (f == NULL)
+    return -ENOMEM;
+  pthread_mutex_init(&f->lock, NULL);
+  f->inode_num = num;
+  inode ino;
+  inode_get(num, &ino);
+  if (ino.type != TYPE_DIR)
+    f->map = emap_get(num, &ino);
+  inode_ref(num, 1);
+  fi->fh = (uintptr_t)f;
+  return 0;
+}
+
+// drop @fi's sfs_file, freeing its inode if this was the last open of
+// an unlinked one
+static void sfs_file_close(struct fuse_file_info *fi)
+{
+  sfs_file *f = SFS_FILE(fi);
+  if (f == NULL)
+    return;
+  inode_unref(f->inode_num, 1);
+  pthread_mutex_destroy(&f->lock);
+  free(f->wbuf);
+  free(f);
+  fi->fh = 0;
+}
+
+// @f's write staging buffer, grown to at least @size bytes
+static char *sfs_file_wbuf(sfs_file *f, size_t size)
+{
+  if (size > f->wbuf_size) {
+    char *p = realloc(f->wbuf, size);
+    if (p == NULL)
+      return NULL;
+    f->wbuf = p;
+    f->wbuf_size = size;
+  }
+  return f->wbuf;
+}
+
+/* Lock the inode an I/O call is for, for writing if @excl is set: the
+ * open file's if @fi has one, so no path is walked, else @path's.
+ * Returns the inode number, or -errno with nothing locked. */
+static int sfs_io_lock(const char *path, struct fuse_file_info *fi, int excl)
+{
+  sfs_file *f = SFS_FILE(fi);
+  if (f == NULL)
+    return sfs_lookup_lock(path, excl);
+  if (excl)
+    pthread_rwlock_wrlock(&inode_locks[f->inode_num]);
+  else
+    pthread_rwlock_rdlock(&inode_locks[f->inode_num]);
+  return f->inode_num;
+}
+
+/* Operations on a name in a directory, shared by both front ends.
+ * The caller holds dir_lock for writing and has checked that @dir is
+ * a live directory. */
+
+// make @name in @dir a new inode of @type; returns it, or -errno
+static int create_locked(int dir, const char *name, int type, int mode)
+{
+  int num = inode_alloc(type, mode);
+  if (num == -ENOSPC && reclaim_sync(RECLAIM_DIR_LOCKED))
+    num = inode_alloc(type, mode);
+  if (num < 0)
+    return num;
+  if (dir_insert(dir, name, num) < 0) {
+    log_msg("create_locked LINE %d: ERROR: DIRECTORY FULL, giving back inode %d\n",__LINE__, num);
+    inode_release(num);
+    return -ENOSPC;
+  }
+  dcache_add(dir, name, num, type);
+  return num;
+}
+
+/* Remove @name, inode @num, from directory @dir and make the inode an
+ * orphan.  Its blocks are left to the reclaimer, which frees them and
+ * the inode once the last reference is gone. */
+static void unlink_locked(int dir, const char *name, int num)
+{
+  char sb_buf[BLOCK_SIZE];
+  inode ino;
+
+  log_msg("unlink_locked LINE %d: DELETING %s, inode %d, from directory %d\n",__LINE__, name, num, dir);
+  dir_remove(dir, name);
+  dcache_remove(num);
+
+  // wait out I/O in flight, which would write back its own copy
+  pthread_rwlock_wrlock(&inode_locks[num]);
+  inode_get(num, &ino);
+  ino.link_count = 0;
+  inode_put(num, &ino);
+  pthread_mutex_lock(&alloc_lock);
+  block_read(0, sb_buf);
+  orphan_set((superblock *)sb_buf, num, 1);
+  block_write(0, sb_buf);
+  pthread_mutex_unlock(&alloc_lock);
+  inode_unlock(num);
+  reclaim_kick();
+}
+
+static int dir_any_fn(void *arg, const direntry *de, off_t pos)
+{
+  return 1;
+}
+
+// whether directory @dir has no entries; the caller holds dir_lock
+static int dir_empty(int dir)
+{
+  return !dir_walk(dir, 0, 0, dir_any_fn, NULL);
+}
+
+// unlink @name from @dir, or rmdir it if @isdir; returns 0 or -errno
+static int remove_locked(int dir, const char *name, int isdir)
+{
+  int type;
+  int num = dir_child(dir, name, &type);
+  if (num == -1)
+    return -ENOENT;
+  if (isdir && type != TYPE_DIR)
+    return -ENOTDIR;
+  if (!isdir && type == TYPE_DIR)
+    return -EISDIR;
+  if (isdir && !dir_empty(num))
+    return -ENOTEMPTY;
+  unlink_locked(dir, name, num);
+  return 0;
+}
+
+/* Move @name in @dir to @newname in @newdir, replacing what is there.
+ * The inode replaced, if any, is stored in *@replaced. */
+static int rename_locked(int dir, const char *name, int newdir, const char *newname, int *replaced)
+{
+  int type, ttype, x;
+  int retstat;
+
+  *replaced = -1;
+  int src = dir_child(dir, name, &type);
+  int target = dir_child(newdir, newname, &ttype);
+  if (src == -1)
+    return -ENOENT;
+  if (target == src)
+    return 0;
+  if (type == TYPE_DIR) {
+    // a directory cannot move below itself; every directory on the
+    // way to newdir has been looked up, so it is in the dentry cache
+    for (x = newdir; x != ROOT_INO && x != -1; x = dcache[x].parent)
+      if (x == src)
+        return -EINVAL;
+  }
+  if (target != -1) {
+    if (ttype == TYPE_DIR && type != TYPE_DIR)
+      return -EISDIR;
+    if (ttype != TYPE_DIR && type == TYPE_DIR)
+      return -ENOTDIR;
+    if (ttype == TYPE_DIR && !dir_empty(target))
+      return -ENOTEMPTY;
+    unlink_locked(newdir, newname, target);
+    *replaced = target;
+  }
+  // enter the new name first, so a full directory leaves the old one
+  retstat = dir_insert(newdir, newname, src);
+  if (retstat == 0) {
+    dir_remove(dir, name);
+    dcache_remove(src);
+    dcache_add(newdir, newname, src, type);
+    log_msg("rename_locked LINE %d: inode %d renamed\n",__LINE__, src);
+  }
+  return retstat;
+}
 
 /**
  * Create and open a file
@@ -292,119 +2321,29 @@ int sfs_getattr(const char *path, struct stat *statbuf)
  *
  * Introduced in version 2.5
  */
-
-//CHECK if file name already exists
-//THIS IS HOW YOU GO THROUGH THE DIRENTRIES
-//block_read(24, buf); // you will need to go through blocks 24-48
-//direntries = (direntry_array *)buf; // direntries is a direntry_array (initialized above)
-
 int sfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
   //log_fi(fi);
-  char buf[512];
   int retstat = 0;
-  int i,j;
   log_msg("\nsfs_create(path=\"%s\", mode=0%03o, fi=0x%08x)\n", path, mode, fi);
-  log_msg("sfs_create LINE %d: SNIGGY SAYS THIS IS THE PATH: %s\n",__LINE__, path);
-  log_msg("now creating file\n");
-
-  //time to go through inode char map to find next free direntry/inode
-  char sb_b[512];
-  block_read(0, sb_b);
-  superblock *sb_buf = (superblock *)sb_b;
-  char *inode_map = sb_buf->inode_map;
-  int free_inode = -1;
-  log_msg("sfs_create LINE %d: num free inodes: %d\n",__LINE__, sb_buf->num_inodes);
-  if(sb_buf->num_inodes > 0){
-    //log_msg("num free inodes: %d\n", sb_buf->num_inodes);
-    for(free_inode = 0; free_inode < 100; free_inode++){
-      log_msg("free_inode num: %d, val: %d\n", free_inode, inode_map[free_inode]);
-      if(inode_map[free_inode] == 0){
-        //WE HAVE A FREE INODE
-        log_msg("FREE INODE: %d\n", free_inode);
-        sb_buf->num_inodes--;
-        inode_map[free_inode] = 1;
-        break;
-      }
-    }
-    if(free_inode == 99){
-      log_msg("sfs_create LINE %d: *ERROR: NO FREE INODES, CANNOT CREATE ANY MORE FILES IN DIRECTORY <should never reach this case>",__LINE__);
-      return retstat;
-    }
-  }
-  else{
-    log_msg("sfs_create LINE %d: ERROR: NO FREE INODES, CANNOT CREATE ANY MORE FILES IN DIRECTORY",__LINE__);
-    return retstat;
-  }
 
-  //time to go through data char map to find next free data block
-  int data_block = -1;
-  int data_index = -1;
-  int datablock_num = 0;
-  int done = 0;
-  char data_buf[512];
-  if(sb_buf->num_datablocks > 0){
-    //log_msg("sfs_create LINE %d: num free datablocks: %d\n",__LINE__, sb_buf->num_datablocks);
-    for(data_block = 1; data_block <= 3; data_block++){
-      block_read(data_block, data_buf);
-      char *data_map = (char *)data_buf;
-      for(data_index = 0; data_index < 367; data_index++){
-        if(data_map[data_index] == 0){
-          //WE HAVE A FREE DATA BLOCK;
-          log_msg("sfs_create LINE %d: FREE DATABLOCK: %d, %d\n",__LINE__, data_block, data_index);
-          sb_buf->num_datablocks--;
-          data_map[data_index] = 1;
-          block_write(data_block, data_buf);
-          done = 1;
-          break;
-        }
-        datablock_num++;
-      }
-      if(done == 1){
-        break;
-      } else if(data_block == 3 && data_index == 366){
-        //NO FREE DATA BLOCK
-        log_msg("sfs_create LINE %d: *ERROR: NO FREE DATA BLOCKS <should never reach this error case>\n",__LINE__);
-      }
-    }
-  }
-  else{
-    log_msg("sfs_create LINE %d: *ERROR: NO FREE DATA BLOCKS <should never reach this error case>\n",__LINE__);
-  }
-
-  log_msg("sfs_create LINE %d: DATABLOCK_NUM: %d\n",__LINE__, datablock_num);
-
-  //find and alter inode struct
-  int inode_block_num = 4 + free_inode/5;
-  int inode_block_index = free_inode%5;
-  log_msg("sfs_create LINE %d: INODE USED AT block %d index %d\n",__LINE__, inode_block_num, inode_block_index);
-  log_msg("sfs_create LINE %d: pointer to datablock %d\n",__LINE__, datablock_num);
-  char inode_buf[512];
-  block_read(inode_block_num, inode_buf);
-  inode_array *inode_block = (inode_array*) inode_buf;
-  for(i = 0; i<=11; i++){
-    if(inode_block->i[inode_block_index].db[i] < 0){
-      inode_block->i[inode_block_index].db[i] = datablock_num;
-      inode_block->i[inode_block_index].mode = (int) mode;
-      log_msg("sfs_create LINE %d: WE HAVE A FREE DATABLOCK!!! %d pointing to %d\n",__LINE__, i, inode_block->i[inode_block_index].db[i]);
-      block_write(inode_block_num, inode_buf);
-      break;
-    }
+  // the name is checked and entered under one write lock, so racing
+  // creates of the same path make a single file
+  char name[120];
+  int type;
+  pthread_rwlock_wrlock(&dir_lock);
+  int dir = path_parent(path, name);
+  if(dir < 0){
+    pthread_rwlock_unlock(&dir_lock);
+    return dir;
   }
-
-  //find and alter direntries struct
-  int direntry_block_num = 24 + free_inode/4;
-  int direntry_block_index = free_inode%4;
-  log_msg("sfs_create LINE %d: DIRENTRY USED AT block %d index %d\n",__LINE__, direntry_block_num, direntry_block_index);
-  char direntry_buf[512];
-  block_read(direntry_block_num, direntry_buf);
-  direntry_array *direntry_block = (direntry_array *)direntry_buf;
-  strncpy(direntry_block->d[direntry_block_index].name, path, 120);
-  direntry_block->d[direntry_block_index].inode_num = free_inode;
-  block_write(direntry_block_num, direntry_buf);
-  log_msg("sfs_create LINE %d: Do we get here??",__LINE__);
-  block_write(0, sb_buf);
-  mode = S_IFREG | 0777;
+  int num = dir_child(dir, name, &type);
+  if(num != -1)
+    log_msg("sfs_create LINE %d: %s already exists as inode %d\n",__LINE__, path, num);
+  else
+    num = create_locked(dir, name, TYPE_FILE, (int) mode);
+  retstat = num < 0 ? num : sfs_file_open(fi, num);
+  pthread_rwlock_unlock(&dir_lock);
   return retstat;
 }
 
@@ -413,94 +2352,45 @@ int sfs_unlink(const char *path)
 {
   log_msg("\nsfs_unlink(path=\"%s\")\n", path);
 
-  int retstat = 0;
-  char buf[512];
-  int i,j, found;
-
-
-  int array[3];
-  int * array_ptr;
-  array_ptr = find_direntry(path, array);
-  found = array_ptr[0];
-  i =   array_ptr[1];
-  j =   array_ptr[2];
-
-  block_read(i, buf);
-  direntry_array *direntries = (direntry_array *)buf;
-
-  log_msg("i: %d j: %d\n", i , j);  
-  
-  if(found != -1) 
-  {
-    log_msg("sfs_unlink LINE %d: DELETING file %s == %s\n",__LINE__, path, direntries->d[j].name);
-
-    // remove file!
-    direntry dirent = direntries->d[j];
-    memset(direntries->d[j].name, '\0', 120);
-
-    //change superblock
-    char sb_buf[512];
-    block_read(0, sb_buf);
-    superblock *sb = (superblock *)sb_buf;
-    sb->num_inodes++;
-    int inode_map_num = (i-24)*4 + j;
-    sb->inode_map[inode_map_num] = 0;
-    log_msg("sfs_unlink LINE %d: CHANGED inode map at index: %d\n",__LINE__, inode_map_num);
-
-    //change inode
-    char inode_buf[512];
-    int inode_block = dirent.inode_num/5+4;
-    int inode_block_index = dirent.inode_num%5;
-    block_read(inode_block, inode_buf);
-    log_msg("inode found at block %d index %d\n", inode_block, inode_block_index);
-    inode_array *inode_arr = (inode_array *)inode_buf;
-    inode curr_inode = inode_arr->i[inode_block_index];
-
-    char datablock_buf[512];
-    int x;
-    for(x = 0; x < 11; x++)
-    {
-      if (curr_inode.db[x] >= 0) {
-        log_msg("sfs_unlink LINE %d: inode datablock value at index %d is %d\n",__LINE__, x, curr_inode.db[x]);
-
-        // increment available datablocks
-        sb->num_datablocks++;
-        // clean datablock
-        log_msg("sfs_unlink LINE %d: cleaned datablock at block %d\n",__LINE__, curr_inode.db[x]+49);
-        block_read(curr_inode.db[x]+49, datablock_buf);
-        memset(datablock_buf, 0, 512);
-        block_write(curr_inode.db[x], datablock_buf);
-
-        // change data map bit
-        int data_map_block = curr_inode.db[x]/366+1;
-        int data_map_index = curr_inode.db[x]%366;
-        log_msg("sfs_unlink LINE %d: data map bit changed at block %d index %d\n",__LINE__, data_map_block, data_map_index);
-        char data_map_buf[512];
-        block_read(data_map_block, data_map_buf);
-        char *data_map = (char *)data_map_buf;
-        data_map[data_map_index] = 0;
-        block_write(data_map_block, data_map_buf);
-
-        inode_arr->i[inode_block_index].db[x] = -1;
-      }
-
-    }
-
-    block_write(inode_block, inode_buf);
-    block_write(i, buf);
-    block_read(i, buf);
-    direntries = (direntry_array *)buf;
-    log_msg("sfs_unlink LINE %d: Name of file is now: %s (SHOULD BE NOTHING)\n",__LINE__, direntries->d[j].name);
-    block_write(0,sb_buf);
-    //change data map
-  }
+  char name[120];
+  int retstat;
+  pthread_rwlock_wrlock(&dir_lock);
+  int dir = path_parent(path, name);
+  if (dir == -EEXIST)
+    retstat = -EISDIR;
+  else if (dir < 0)
+    retstat = dir;
+  else
+    retstat = remove_locked(dir, name, 0);
+  pthread_rwlock_unlock(&dir_lock);
+  return retstat;
+}
 
-  log_msg("i: %d j: %d\n", i , j);
-  if(found == -1)
-  {
-    log_msg("sfs_unlink LINE %d: ERROR: CANNOT DELETE FILE, FILE NOT FOUND.\n",__LINE__);
+/** Rename a file
+ *
+ * An existing file at @newpath is replaced, and so is an empty
+ * directory if the source is a directory.  Only the direntry moves,
+ * to the leaf for its new hash in the new directory; the inode and
+ * its data stay where they are.
+ */
+int sfs_rename(const char *path, const char *newpath)
+{
+  log_msg("\nsfs_rename(path=\"%s\", newpath=\"%s\")\n", path, newpath);
+
+  char name[120], newname[120];
+  int retstat, replaced;
+
+  pthread_rwlock_wrlock(&dir_lock);
+  int dir = path_parent(path, name);
+  int newdir = path_parent(newpath, newname);
+  if (dir < 0 || newdir < 0) {
+    retstat = dir < 0 ? dir : newdir;
+    if (retstat == -EEXIST)
+      retstat = -EBUSY;
+  } else {
+    retstat = rename_locked(dir, name, newdir, newname, &replaced);
   }
-  free(array_ptr);
+  pthread_rwlock_unlock(&dir_lock);
   return retstat;
 }
 
@@ -519,40 +2409,30 @@ int sfs_open(const char *path, struct fuse_file_info *fi)
   log_msg("\nsfs_open(path\"%s\", fi=0x%08x)\n", path, fi);
 
   int retstat = 0;
-  int fd;
 //  (void) fi;
   //finding direntry for file 
   log_msg("sfs_open LINE %d: entering find_direntry with path %s\n",__LINE__, path);
-  int array[3];
-  int * array_ptr;
-  int inode_num = (find_direntry( path, array ))[0];
+  pthread_rwlock_rdlock(&dir_lock);
+  int inode_num = find_direntry( path );
+  if( inode_num != -1 )
+    retstat = sfs_file_open(fi, inode_num);
+  pthread_rwlock_unlock(&dir_lock);
   log_msg("sfs_open LINE %d: leaving find_direntry with inode_num %d\n",__LINE__,inode_num );
 
+  // O_CREAT comes through sfs_create, never here
   if( inode_num == -1 )
   {
-    log_msg("sfs_open LINE %d FLAGS: %d\n",__LINE__, fi->flags);
-    if( (int)fi->flags == 34817 || (int)fi->flags == 33793 ) {
-      log_msg("sfs_open LINE %d: reating file...\n",__LINE__);
-      sfs_create(path, 0, fi);
-    } else {
-      log_msg("sfs_open LINE %d ERROR: CANNOT CREATE FILE\n",__LINE__);
-      free(array_ptr);
-      return retstat; //should this return something that isn't zero?
-    }
+    log_msg("sfs_open LINE %d ERROR: no such file\n",__LINE__);
+    return -ENOENT;
   }
 
-  fd = open(path, fi->flags);
-  log_msg("sfs_open LINE %d: Did open() work?\n",__LINE__);
-  fd = 1;//This seems like  a hack to keep things working, should probably fix!
-
-  if( fd < 0 ) 
+  if (retstat == -ENOMEM)
   {
+    errno = ENOMEM;
     retstat = sfs_error("sfs_open open");
   }
 
-  fi->fh = fd;
   log_fi(fi);
-  free(array_ptr);
   return retstat;
 }
 
@@ -576,7 +2456,7 @@ int sfs_release(const char *path, struct fuse_file_info *fi)
   log_msg("\nsfs_release(path=\"%s\", fi=0x%08x)\n", path, fi);
 
   //log_fi(fi);
-  fi->fh = 0;
+  sfs_file_close(fi);
   //log_msg("This is the fi after setting fi->fh to 0\n");
   //log_fi(fi);
   return retstat;
@@ -593,102 +2473,144 @@ int sfs_release(const char *path, struct fuse_file_info *fi)
  *
  * Changed in version 2.2
  */
+/* Sequential read detection: a read that starts where the previous
+ * one ended grows the window (doubling up to RA_MAX), anything else
+ * collapses it.  While the window is open, the blocks of the file up
+ * to ra_window past the current request are prefetched, each one
+ * only once. */
+static void sfs_readahead(sfs_file *f, const extent_map *m, off_t offset, size_t size, int next_block)
+{
+  if (f == NULL)
+    return;
+  pthread_mutex_lock(&f->lock);
+  if (offset == f->next_offset) {
+    f->ra_window = f->ra_window ? f->ra_window*2 : RA_MIN;
+    if (f->ra_window > RA_MAX)
+      f->ra_window = RA_MAX;
+  } else {
+    f->ra_window = 0;
+    f->ra_next = 0;
+  }
+  f->next_offset = offset + size;
+  if (f->ra_window == 0) {
+    pthread_mutex_unlock(&f->lock);
+    return;
+  }
+
+  int start = f->ra_next > next_block ? f->ra_next : next_block;
+  int end = next_block + f->ra_window;
+  int nums[RA_MAX];
+  int n = end > start ? inode_blocks(m, start, end - start, nums) : 0;
+  f->ra_next = start + n;
+  pthread_mutex_unlock(&f->lock);
+  if (n > 0) {
+    log_msg("sfs_readahead: window %d, prefetching file blocks %d-%d\n", f->ra_window, start, start+n-1);
+    block_prefetch(nums, drop_holes(nums, n));
+  }
+}
+
 int sfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
   log_msg("\nsfs_read(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n", path, buf, size, offset, fi);
-  (void) fi;
-  int retstat = 0;
-  
-  int offset_copy = offset;
-  //log_msg("sfs_read LINE %d: BUF BEFORE: %s\n",__LINE__, buf);
-  memset( buf, '\0' , sizeof(buf) );
-  //log_msg("sfs_read LINE %d: BUF AFTER: %s\n",__LINE__, buf);
-  //log_fi(fi);
 
   //finding direntry for file 
-  log_msg("sfs_write LINE %d: entering find_direntry with path %s\n",__LINE__, path);
-  int array[3];
-  int * array_ptr;
-  int inode_num = (find_direntry( path, array ))[0];
-  log_msg("sfs_write LINE %d: leaving find_direntry with inode_num %d\n",__LINE__,inode_num );
+  sfs_file *f = SFS_FILE(fi);
+  int inode_num = sfs_io_lock( path, fi, 0 );
+  log_msg("sfs_read LINE %d: reading inode %d\n",__LINE__,inode_num );
 
-  if(inode_num == -1 )
+  if(inode_num < 0 )
   {
-    log_msg("sfs_read LINE: READ ERROR: file to read from not found\n",__LINE__);
-    free(array_ptr);
-    return -1;//maybe -1?
-  }
-
-
-  log_msg("sfs_read LINE %d: READING from file now:\n",__LINE__);
-  int inode_block = inode_num/5 + 4;
-  int inode_block_index = inode_num%5;
-  log_msg("sfs_read LINE %d: Inode block num: %d, inode index num: %d\n",__LINE__, inode_block, inode_block_index);
-  char inode_buf[512];
-  memset(inode_buf, '\0', 512);
-  block_read(inode_block, inode_buf);
-  inode_array *inode_arr = (inode_array *)inode_buf;
-
-  //CHANGE
-  int x=1;
-  int first_db_block = offset/512;
-  log_msg("sfs_read LINE %d: first_db_block: %d\n",__LINE__, first_db_block);
-  int last_db_block = (offset+size)/512;
-  log_msg("sfs_read LINE %d: last_db_block: %d\n",__LINE__,  last_db_block);
-
-  if ((offset+size)%512 > 0){
-    last_db_block++;
-  }
-
-  log_msg("sfs_read LINE %d: 0last_db_block: %d\n",__LINE__, last_db_block);
-  int bytes_read = 0;
-  char db_buf[512];
-  memset(db_buf, '\0', 512);
-  log_msg("sfs_read LINE %d: inside buf: %s\n",__LINE__, buf);
-  for (x = first_db_block; x<last_db_block; x++)
-   {
-    log_msg("sfs_read LINE %d: x: %d\n",__LINE__, x);
-    if (inode_arr->i[inode_block_index].db[x] < 0)
-    {
-      log_msg("sfs_read LINE %d: <0bytes_read %d\n",__LINE__, bytes_read);
-      break;
-      //return bytes_read;
-    }else 
-    {
-      block_read(inode_arr->i[inode_block_index].db[x] + 49, db_buf);
-      log_msg("sfs_read LINE %d: READING from i = %d: %s\n",__LINE__, inode_arr->i[inode_block_index].db[x] + 49, db_buf);
-      //log_msg("INSIDE index %d is block %d: %s\n", x,inode_arr->i[inode_block_index].db[x] + 49, db_buf);
-
-      if(x==first_db_block){
-        log_msg("sfs_read LINE %d: I am in the first block x: %d\n",__LINE__, x);
-        log_msg("LENGTH: %d\n", (int)strlen(db_buf));
-        strncpy(buf, db_buf+(offset%512), 512-(offset%512));//assuming write null terminates properly
-        bytes_read += (int)strlen(db_buf);
-        log_msg("offset: %d bytes read: %d, int bytes: %d\n", (offset%512), strlen(db_buf), bytes_read);
-        log_msg("sfs_read LINE %d: bytes_read %d\n",__LINE__, bytes_read);
-      } else if(x==last_db_block-1) {
-        log_msg("sfs_read LINE %d: I am in the last block x: %d\n",__LINE__, x);
-        strncpy(buf+bytes_read, db_buf, size-bytes_read);
-        bytes_read += size-bytes_read;
-        log_msg("sfs_read LINE %d: bytes_read %d\n",__LINE__, bytes_read);
-      } else {
-        log_msg("sfs_read LINE %d: I am in the middle block x: %d\n",__LINE__, x);
-        strncpy(buf+bytes_read, db_buf, 512);
-        bytes_read += 512;
-        log_msg("sfs_read LINE %d: bytes_read %d\n",__LINE__, bytes_read);
-      }
-    }
-   }
+    log_msg("sfs_read LINE %d: READ ERROR: file to read from not found\n",__LINE__);
+    return inode_num;
+  }
 
-  log_msg("sfs_read LINE %d: bytes_read before strcat buf with null term %d\n",__LINE__, bytes_read);
-  if(bytes_read==0){
+  if (offset < 0)
+  {
+    inode_unlock(inode_num);
+    return -EINVAL;
+  }
+  inode ino;
+  inode_get(inode_num, &ino);
+  // nothing past the end of the file
+  if (offset >= ino.size_written)
+  {
+    inode_unlock(inode_num);
     return 0;
   }
-  strcat(buf+bytes_read, "\n\0");
-  log_msg("sfs_read LINE %d: BUF AFTER: %s, length: %d",__LINE__, buf, sizeof(buf));
-  free(array_ptr);
-  
-  return bytes_read+1;
+  if (size > ino.size_written - offset)
+    size = ino.size_written - offset;
+
+  if (ino.flags & INODE_INLINE)
+  {
+    // a small file is served from the inode, no data block to read
+    memcpy(buf, ino.data + offset, size);
+    inode_unlock(inode_num);
+    return size;
+  }
+
+  extent_map *m = f ? f->map : NULL;
+  if (m == NULL)
+    m = emap_get(inode_num, &ino);
+  if (m == NULL)
+  {
+    inode_unlock(inode_num);
+    return -ENOMEM;
+  }
+
+  // the range lies within the file, so its block numbers fit an int
+  int first_db_block = (int)(offset/BLOCK_SIZE);
+  int last_db_block = (int)((offset+(off_t)size+BLOCK_SIZE-1)/BLOCK_SIZE);
+  log_msg("sfs_read LINE %d: blocks %d to %d\n",__LINE__, first_db_block, last_db_block);
+
+  // gather the mapped blocks so adjacent ones are read in one go; a
+  // growing truncate leaves the end of a file unmapped and a write past
+  // the end leaves holes, and both read as zeroes without touching the
+  // disk
+  int count = last_db_block - first_db_block;
+  int *db_nums = malloc((2 * count + 1) * sizeof(int));
+  char *db_bufs = malloc((size_t)count*BLOCK_SIZE + 1);
+  if (db_nums == NULL || db_bufs == NULL)
+  {
+    free(db_nums);
+    free(db_bufs);
+    inode_unlock(inode_num);
+    return -ENOMEM;
+  }
+  int nblocks = inode_blocks(m, first_db_block, count, db_nums);
+  int *rd_nums = db_nums + nblocks;
+  memcpy(rd_nums, db_nums, nblocks * sizeof(int));
+  int nread = drop_holes(rd_nums, nblocks);
+  if (block_readv(rd_nums, nread, db_bufs) < 0)
+  {
+    free(db_nums);
+    free(db_bufs);
+    inode_unlock(inode_num);
+    return -EIO;
+  }
+  // the blocks read are packed at the front; spread them out from the
+  // back, so none is overwritten before it moves, zeroing the holes
+  int x;
+  for (x = nblocks - 1; x >= 0; x--)
+  {
+    char *dst = db_bufs + (size_t)x*BLOCK_SIZE;
+    if (db_nums[x] == 0)
+      memset(dst, 0, BLOCK_SIZE);
+    else if (--nread != x)
+      memcpy(dst, db_bufs + (size_t)nread*BLOCK_SIZE, BLOCK_SIZE);
+  }
+  sfs_readahead(f, m, offset, size, last_db_block);
+
+  size_t head = offset % BLOCK_SIZE;
+  size_t mapped = (size_t)nblocks*BLOCK_SIZE > head ? (size_t)nblocks*BLOCK_SIZE - head : 0;
+  if (mapped > size)
+    mapped = size;
+  memcpy(buf, db_bufs + head, mapped);
+  memset(buf + mapped, 0, size - mapped);
+  free(db_bufs);
+  free(db_nums);
+
+  inode_unlock(inode_num);
+  return size;
 }
 
 
@@ -705,204 +2627,302 @@ int sfs_write(const char *path, const char *buf, size_t size, off_t offset,
   int retstat = 0;
   log_msg("\nsfs_write(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n", path, buf, size, offset, fi);
 
-  //finding direntry for file
+  // writes come through the handle open or create made; without one
+  // there is nothing to write to
+  sfs_file *f = SFS_FILE(fi);
+  if (f == NULL)
+  {
+    log_msg("sfs_write LINE %d: ERROR: no open file\n",__LINE__);
+    return -EBADF;
+  }
+  int inode_num = sfs_io_lock( path, fi, 1 );
+  log_msg("sfs_write LINE %d: writing inode %d\n",__LINE__,inode_num );
+
+  // the block numbers below are ints; refuse what they cannot reach
+  // before working any of them out
+  if (offset < 0 || size > (size_t)FILE_MAX_BYTES ||
+      offset > FILE_MAX_BYTES - (off_t)size)
+  {
+    inode_unlock(inode_num);
+    return offset < 0 ? -EINVAL : -EFBIG;
+  }
+
+  inode ino;
+  inode_get(inode_num, &ino);
+
+  if ((ino.flags & INODE_INLINE) && offset + (off_t)size <= INODE_INLINE_MAX)
+  {
+    // still small enough: only the inode changes
+    memcpy(ino.data + offset, buf, size);
+    if (offset + size > ino.size_written)
+      ino.size_written = offset + size;
+    inode_put(inode_num, &ino);
+    inode_unlock(inode_num);
+    return size;
+  }
+
+  int first_db_block = (int)(offset/BLOCK_SIZE);
+  int last_db_block = (int)((offset+(off_t)size+BLOCK_SIZE-1)/BLOCK_SIZE);
 
-  log_msg("sfs_write LINE %d: entering find_direntry with path %s\n",__LINE__, path);
-  int array[3];
-  int * array_ptr;
-  int inode_num = (find_direntry( path, array ))[0];
-  log_msg("sfs_write LINE %d: leaving find_direntry with inode_num %d\n",__LINE__,inode_num );
+  log_msg("sfs_write LINE %d: size: %d, offset: %d, first: %d, last: %d\n",__LINE__, size, offset, first_db_block, last_db_block);
 
-  if(inode_num == -1)
+  // the range is staged whole and written back at once, so every
+  // block costs one write.  Only a partly covered block at either
+  // edge needs its old contents, and only if it held data before this
+  // write: a block this write allocated has never been written, and
+  // its old contents are zeroes from memory
+  int nblocks = last_db_block - first_db_block;
+  // the staging buffers live in the open file, so steady writes
+  // through one handle do not allocate; the block numbers are there
+  // twice, as they were before the write and as it leaves them
+  size_t nums_size = (2 * nblocks + 1) * sizeof(int);
+  size_t stage_size = nums_size + (size_t)nblocks*BLOCK_SIZE;
+  char *stage = sfs_file_wbuf(f, stage_size);
+  if (stage == NULL)
   {
-    log_msg("sfs_write LINE %d: ERROR: file to write to not found\n",__LINE__);
-    sfs_create(path, 0, fi);
-    // for testing (reads)
-    //log_msg("sfs_write LINE %d: testing reads, going into find_direntry with path: %s",__LINE__, path);
-
-    /*
-       DOES ALL THIS DO IS TEST??? SHOULD WE REFACTOR IT OR CAN WE SAFELY REMOVE IT DOWN THE LINE??
-       char dir_buf[512];
-       int i, j;
-       for(i = 24; i <= 48; i++){
-       block_read(i, dir_buf);
-       direntry_array *direntries = (direntry_array *)dir_buf;
-       for(j = 0; j < 4; j++){
-       if(strcmp(direntries->d[j].name, path) == 0){
-       log_msg("sfs_write LINE %d: FOUND file to write to\n", __LINE__);
-       inode_num = direntries->d[j].inode_num;
-       j = -1;
-       break;
-       } 
-       }
-       block_write(i, dir_buf);
-       if(j==-1){
-       break;
-       }
-       }
-    // end test
-    */
-  }
-
-  //testing
-  char sb_buf[512];
+    inode_unlock(inode_num);
+    return -ENOMEM;
+  }
+  int *db_nums = (int *)stage;
+  int *old_nums = db_nums + nblocks;
+  char *db_bufs = stage + nums_size;
+
+  pthread_mutex_lock(&alloc_lock);
+  char sb_buf[BLOCK_SIZE];
   block_read(0, sb_buf);
   superblock *sb = (superblock *)sb_buf;
-  log_msg("sfs_write LINE %d: NUM INODES REM before: %d\n",__LINE__, sb->num_inodes);
-  block_write(0, sb);
-  // end test
 
-  int inode_block = inode_num/5 + 4;
-  int inode_block_index = inode_num%5;
-  char inode_buf[512];
-  block_read(inode_block, inode_buf);
-  inode_array *inode_arr = (inode_array *)inode_buf;
+  // grow the file up to the end of the write; appending mostly just
+  // lengthens the last extent
+  extent_map *m = f->map ? f->map : emap_get(inode_num, &ino);
+  if (m == NULL)
+    retstat = -ENOMEM;
+  else
+  {
+    orphan_finish(sb, inode_num, &ino);
+    if ((ino.flags & INODE_INLINE) && inode_uninline(sb, inode_num, &ino) < 0)
+      retstat = -ENOSPC;
+  }
+  if (retstat < 0)
+  {
+    log_msg("sfs_write LINE %d: *ERROR: %d\n",__LINE__, retstat);
+    pthread_mutex_unlock(&alloc_lock);
+    inode_unlock(inode_num);
+    return retstat;
+  }
 
-  int x;
-  int first_db_block = offset/512;
-  int last_db_block = (offset+size)/512;
-  if ((offset+size)%512 > 0){
-    last_db_block++;
+  // which blocks of the range hold data already; the rest, appended
+  // or in holes, are what the write allocates
+  int have = m->nblocks;
+  int old = inode_blocks(m, first_db_block, nblocks, old_nums);
+  int x, need = nblocks - old;
+  for (x = 0; x < old; x++)
+    if (old_nums[x] == 0)
+      need++;
+  if (need > sb->num_datablocks && bitmap_weight(orphan_map, SFS_NUM_INODES) > 0)
+  {
+    // the space may be held by orphans the reclaimer has not freed yet
+    pthread_mutex_unlock(&alloc_lock);
+    reclaim_sync(RECLAIM_SYNC);
+    pthread_mutex_lock(&alloc_lock);
+    block_read(0, sb_buf);
   }
-  if (last_db_block > 11){
-    last_db_block = 11;
+  int end = inode_fill(sb, inode_num, &ino, first_db_block, last_db_block);
+  // a full disk cuts the write short at the last block it got; with
+  // none at all, drop any hole left behind the old end
+  if (end <= first_db_block)
+  {
+    log_msg("sfs_write LINE %d: *ERROR: NO FREE DATA BLOCKS\n",__LINE__);
+    inode_trim(sb, inode_num, &ino, have, INT_MAX);
   }
-  int bytes_written = 0;
-  char db_buf[512];
-  char db_buf_cp[512];
-  //log_msg("inside buf: %s\n", buf);
+  block_write(0, sb);
+  pthread_mutex_unlock(&alloc_lock);
 
-  log_msg("sfs_write LINE %d: size: %d, offset: %d, first: %d, last: %d\n",__LINE__, size, offset, first_db_block, last_db_block);
+  if (end <= first_db_block)
+  {
+    inode_put(inode_num, &ino);
+    inode_unlock(inode_num);
+    return -ENOSPC;
+  }
+  if (end < last_db_block)
+  {
+    last_db_block = end;
+    size = (off_t)end*BLOCK_SIZE - offset;
+  }
+  nblocks = inode_blocks(m, first_db_block, last_db_block - first_db_block, db_nums);
 
-  for (x = first_db_block; x<last_db_block; x++){
-    if (inode_arr->i[inode_block_index].db[x] < 0)
-    {
-      int data_block = -1;
-      int data_index = -1;
-      int datablock_num = 0;
-      int done = 0;
-      char data_buf[512];
-
-      if(sb->num_datablocks > 0)
-      {
-        //log_msg("sfs_write LINE %d: num free datablocks: %d\n",__LINE__, sb_buf->num_datablocks);
-        for(data_block = 1; data_block <= 3; data_block++)
-        {
-          block_read(data_block, data_buf);
-          char *data_map = (char *)data_buf;
-          for(data_index = 0; data_index < 367; data_index++)
-          {
-            if(data_map[data_index] == 0)
-            {
-              //WE HAVE A FREE DATA BLOCK;
-              log_msg("sfs_write LINE %d: FREE DATABLOCK: %d, %d\n",__LINE__, data_block, data_index);
-              //clean and reset data block (just in case)
-              char set_block[512];
-              block_read(datablock_num, set_block);
-              memset(set_block, '\0', 512);
-              block_write(datablock_num, set_block);
-
-              sb->num_datablocks--;
-              data_map[data_index] = 1;
-              block_write(data_block, data_buf);
-              done = 1;
-              break;
-            }
-
-            datablock_num++;
-            log_msg("sfs_write LINE %d: db = %d is now %d\n",__LINE__, inode_arr->i[inode_block_index].db[x], datablock_num);
-            inode_arr->i[inode_block_index].db[x] = datablock_num;
-            //log_msg("sfs_write LINE %d: getting datablock num: %d\n",__LINE__, inode_arr->i[inode_block_index].db[x]);
-          }
-
-          if (done == 1) { 
-            break;
-          } else if(data_block == 3 && data_index == 366) {
-            //NO FREE DATA BLOCK
-            block_write(data_block, data_buf);
-            log_msg("sfs_write LINE %d: *ERROR: NO FREE DATA BLOCKS <should never reach this error case>\n",__LINE__);
-          }
-        }
-      }
-      else{
-        block_write(data_block, data_buf);
-        log_msg("sfs_write LINE %d: *ERROR: NO FREE DATA BLOCKS <should never reach this error case>\n",__LINE__);
-      }
-    }
+  size_t head = offset % BLOCK_SIZE;
+  size_t tail = (offset + size) % BLOCK_SIZE;
+  if (head)
+  {
+    if (old > 0 && old_nums[0])
+      retstat = block_read(old_nums[0], db_bufs);
+    else
+      memset(db_bufs, 0, BLOCK_SIZE);
+  }
+  if (tail && (nblocks > 1 || !head) && retstat >= 0)
+  {
+    char *last = db_bufs + (size_t)(nblocks-1)*BLOCK_SIZE;
+    if (old >= nblocks && old_nums[nblocks-1])
+      retstat = block_read(old_nums[nblocks-1], last);
+    else
+      memset(last, 0, BLOCK_SIZE);
+  }
+  if (retstat >= 0)
+  {
+    memcpy(db_bufs + head, buf, size);
+    retstat = block_writev(db_nums, nblocks, db_bufs);
+  }
+  if (retstat < 0)
+  {
+    // the file stays as it was: blocks past the old end go back, and
+    // the ones put in holes, which cannot go back to being holes, are
+    // punched so they read as zeroes rather than whatever half made it
+    log_msg("sfs_write LINE %d: *ERROR: I/O error, giving back what was allocated\n",__LINE__);
+    int nfilled = 0;
+    for (x = 0; x < old && x < nblocks; x++)
+      if (old_nums[x] == 0)
+        old_nums[nfilled++] = db_nums[x];
+    pthread_mutex_lock(&alloc_lock);
+    block_read(0, sb_buf);
+    block_discard(old_nums, nfilled);
+    inode_trim(sb, inode_num, &ino, have, INT_MAX);
+    block_write(0, sb);
+    pthread_mutex_unlock(&alloc_lock);
+    inode_put(inode_num, &ino);
+    inode_unlock(inode_num);
+    return -EIO;
+  }
 
-    memset(db_buf, '\0', 512);
-    //log_msg("sfs_write LINE %d: db: %d\n",__LINE__, inode_arr->i[inode_block_index].db[x]);
-    block_read(inode_arr->i[inode_block_index].db[x] + 49, db_buf);
-    memset(db_buf_cp, '\0', 512);
-    //log_msg("sfs_write LINE %d: before write: READING from i = %d: %s\n\n\n",__LINE__, x, db_buf);
-    if(x==first_db_block)
-    {
-      strncpy(db_buf_cp, db_buf, (offset%512));
-
-      if(size > (512 - offset%512)) {
-        strncpy(db_buf_cp, buf, (512 - offset%512));
-        bytes_written += 512 - offset%512;
-        inode_arr->i[inode_block_index].size_written = inode_arr ->i[inode_block_index].size_written + bytes_written;
-
-      } else if(size > 0) {
-        log_msg("sfs_write LINE %d: size: %d\n",__LINE__, size);
-        strncpy(db_buf_cp+(offset%512), buf, size);
-        strncpy(db_buf_cp+size+(offset%512)-1, db_buf+size-1, 512-size-offset%512+2);
-        //log_msg("sfs_write LINE %d: db_buf+size: %s\n",__LINE__, db_buf+size);
-        bytes_written += size;
-        inode_arr->i[inode_block_index].size_written = inode_arr ->i[inode_block_index].size_written + bytes_written;
-      }
-    } else if(x==last_db_block-1) 
-    {
-      if((offset+size)%512 < 512)
-      {
-        //log_msg("sfs_write LINE %d: here\n",__LINE__);
-        if(size == 4096) {
-          strncpy(db_buf_cp, db_buf, 512);
-          strncpy(db_buf_cp, buf+bytes_written, (offset+size)%512-1);
-        } else {
-          strncpy(db_buf_cp, buf+bytes_written, (offset+size)%512-1);
-          bytes_written += (offset+size)%512;
-          strncpy(db_buf_cp+(offset+size)%512-1, db_buf+(offset+size)%512-1, 512-(size+offset)%512-1);
-          inode_arr->i[inode_block_index].size_written = inode_arr ->i[inode_block_index].size_written + bytes_written;
-        }
-      } else 
-      {
-        strncpy(db_buf_cp, buf+bytes_written, (offset+size)%512);
-        bytes_written += (offset+size)%512;
-        strncpy(db_buf_cp+((offset+size)%512), buf+bytes_written, 512 - (offset+size)%512);
-        inode_arr->i[inode_block_index].size_written = inode_arr ->i[inode_block_index].size_written + bytes_written;
-
-        //log_msg("sfs_write LINE %d: last written: %d\n",__LINE__, bytes_written);
+  if (offset + size > ino.size_written)
+    ino.size_written = offset + size;
+  inode_put(inode_num, &ino);
+  inode_unlock(inode_num);
+  return size;
+}
 
-      }
-    } else 
-    {
-      //log_msg("sfs_write LINE %d: putting in datablock %d: %s\n",__LINE__, x, buf+bytes_written);
-      strncpy(db_buf_cp, buf+bytes_written, 512);
-      bytes_written += 512;
-      inode_arr->i[inode_block_index].size_written = inode_arr ->i[inode_block_index].size_written + bytes_written;
+/* Set the size of file @num to @size.  Blocks past the new end are
+ * left to the reclaimer; only the block the end falls in is touched
+ * here.  The caller holds the inode's write lock. */
+static int inode_truncate(int num, off_t size)
+{
+  char sb_buf[BLOCK_SIZE];
+  superblock *sb = (superblock *)sb_buf;
+  inode ino;
+  int orphan = 0, blk;
+
+  inode_get(num, &ino);
+  if (ino.type == TYPE_DIR)
+    return -EISDIR;
+  if (size < 0)
+    return -EINVAL;
+  if (size > FILE_MAX_BYTES)
+    return -EFBIG;
+  if ((ino.flags & INODE_INLINE) && size <= INODE_INLINE_MAX)
+  {
+    if (size < ino.size_written)
+      memset(ino.data + size, 0, INODE_INLINE_MAX - size);
+    ino.size_written = size;
+    inode_put(num, &ino);
+    return 0;
+  }
 
-    }
-    block_write(inode_arr->i[inode_block_index].db[x] + 49, db_buf_cp);
-  }
-  block_write(inode_block, inode_buf);
-  //log_msg("sfs_write LINE %d: NUM INODES REM after: %d\n",__LINE__, sb->num_inodes);
-
-  //testing (reads)
-  int y;
-  for(y = 0; y<11; y++){
-    if(inode_arr->i[inode_block_index].db[y] >= 0){
-      block_read(inode_arr->i[inode_block_index].db[y] + 49, db_buf);
-      log_msg("sfs_write LINE %d: READING from i = %d, db = %d: %s\n",__LINE__, y, inode_arr->i[inode_block_index].db[y] + 49, db_buf);
-      block_write(inode_arr->i[inode_block_index].db[y] + 49, db_buf);
-    }
-    else break;
+  pthread_mutex_lock(&alloc_lock);
+  block_read(0, sb_buf);
+  extent_map *m = emap_get(num, &ino);
+  if (m == NULL)
+  {
+    pthread_mutex_unlock(&alloc_lock);
+    return -ENOMEM;
+  }
+  if ((ino.flags & INODE_INLINE) && inode_uninline(sb, num, &ino) < 0)
+  {
+    pthread_mutex_unlock(&alloc_lock);
+    return -ENOSPC;
+  }
+  orphan_finish(sb, num, &ino);
+  off_t old = ino.size_written;
+  ino.size_written = size;
+  if (INODE_KEEP(&ino) < m->nblocks)
+  {
+    orphan_set(sb, num, 1);
+    orphan = 1;
+  }
+  block_write(0, sb_buf);
+  pthread_mutex_unlock(&alloc_lock);
 
+  // what the new end cuts off or uncovers in its block reads as zeroes
+  off_t from = size < old ? size : old;
+  if (from % BLOCK_SIZE && inode_blocks(m, from / BLOCK_SIZE, 1, &blk) == 1 && blk)
+  {
+    char buf[BLOCK_SIZE];
+    block_read(blk, buf);
+    memset(buf + from % BLOCK_SIZE, 0, BLOCK_SIZE - from % BLOCK_SIZE);
+    block_write(blk, buf);
   }
-  // end test
-  free(array_ptr);
-  return bytes_written;
+  inode_put(num, &ino);
+  if (orphan)
+    reclaim_kick();
+  return 0;
+}
+
+/** Change the size of a file */
+int sfs_truncate(const char *path, off_t newsize)
+{
+  log_msg("\nsfs_truncate(path=\"%s\", newsize=%lld)\n", path, newsize);
+
+  int inode_num = sfs_lookup_lock(path, 1);
+  if (inode_num < 0)
+    return inode_num;
+  int retstat = inode_truncate(inode_num, newsize);
+  inode_unlock(inode_num);
+  return retstat;
+}
+
+/** Change the size of an open file */
+int sfs_ftruncate(const char *path, off_t newsize, struct fuse_file_info *fi)
+{
+  log_msg("\nsfs_ftruncate(path=\"%s\", newsize=%lld, fi=0x%08x)\n", path, newsize, fi);
+
+  int inode_num = sfs_io_lock(path, fi, 1);
+  if (inode_num < 0)
+    return inode_num;
+  int retstat = inode_truncate(inode_num, newsize);
+  inode_unlock(inode_num);
+  return retstat;
+}
+
+/** Possibly flush cached data
+ *
+ * Called on each close() of a file descriptor.  Dirty inodes and
+ * blocks are written back to the disk file, but not forced to stable
+ * storage.
+ */
+int sfs_flush(const char *path, struct fuse_file_info *fi)
+{
+  log_msg("\nsfs_flush(path=\"%s\", fi=0x%08x)\n", path, fi);
+
+  // both, even if the inodes fail: the data blocks may still make it
+  int retstat = inode_flush();
+  if (block_flush() < 0 || retstat < 0)
+    return -EIO;
+  return 0;
+}
+
+/** Synchronize file contents
+ *
+ * There is no per-file dirty state in the inode or block caches, so
+ * both datasync and full fsync write back everything and fsync the
+ * disk.
+ */
+int sfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+  log_msg("\nsfs_fsync(path=\"%s\", datasync=%d, fi=0x%08x)\n", path, datasync, fi);
+
+  int retstat = inode_flush();
+  if (block_sync() < 0 || retstat < 0)
+    return -EIO;
+  return 0;
 }
 
 /** Create a directory */
@@ -911,6 +2931,19 @@ int sfs_mkdir(const char *path, mode_t mode)
   int retstat = 0;
   log_msg("\nsfs_mkdir(path=\"%s\", mode=0%3o)\n", path, mode);
 
+  char name[120];
+  int type;
+  pthread_rwlock_wrlock(&dir_lock);
+  int dir = path_parent(path, name);
+  if (dir < 0) {
+    retstat = dir;
+  } else if (dir_child(dir, name, &type) != -1) {
+    retstat = -EEXIST;
+  } else {
+    int num = create_locked(dir, name, TYPE_DIR, S_IFDIR | mode);
+    retstat = num < 0 ? num : 0;
+  }
+  pthread_rwlock_unlock(&dir_lock);
   return retstat;
 }
 
@@ -921,6 +2954,16 @@ int sfs_rmdir(const char *path)
   int retstat = 0;
   log_msg("sfs_rmdir(path=\"%s\")\n", path);
 
+  char name[120];
+  pthread_rwlock_wrlock(&dir_lock);
+  int dir = path_parent(path, name);
+  if (dir == -EEXIST)
+    retstat = -EBUSY;
+  else if (dir < 0)
+    retstat = dir;
+  else
+    retstat = remove_locked(dir, name, 1);
+  pthread_rwlock_unlock(&dir_lock);
   return retstat;
 }
 
@@ -935,8 +2978,18 @@ int sfs_rmdir(const char *path)
 int sfs_opendir(const char *path, struct fuse_file_info *fi)
 {
   int retstat = 0;
+  int type;
   log_msg("\nsfs_opendir(path=\"%s\", fi=0x%08x)\n", path, fi);
 
+  pthread_rwlock_rdlock(&dir_lock);
+  int num = path_walk(path, strlen(path), &type);
+  if (num < 0)
+    retstat = num;
+  else if (type != TYPE_DIR)
+    retstat = -ENOTDIR;
+  else
+    retstat = sfs_file_open(fi, num);
+  pthread_rwlock_unlock(&dir_lock);
   return retstat;
 }
 
@@ -961,36 +3014,78 @@ int sfs_opendir(const char *path, struct fuse_file_info *fi)
  *
  * Introduced in version 2.3
  */
+struct dir_list_arg {
+  sfs_dirent_fn fn;
+  void *arg;
+};
+
+static int dir_list_fn(void *arg, const direntry *de, off_t pos)
+{
+  struct dir_list_arg *la = arg;
+  struct stat st;
+  inode_stat(de->inode_num, &st);
+  return la->fn(la->arg, de->name, &st, pos + 1);
+}
+
+/* List directory @dir from readdir offset @offset on, handing @fn each
+ * name, its attributes from the inode cache and the offset of the
+ * entry after it, until @fn returns nonzero (its buffer is full).
+ * The caller holds dir_lock. */
+static void dir_list(int dir, off_t offset, sfs_dirent_fn fn, void *arg)
+{
+  struct dir_list_arg la = { fn, arg };
+  struct stat st;
+  int parent;
+
+  if (offset < 1) {
+    inode_stat(dir, &st);
+    if (fn(arg, ".", &st, 1))
+      return;
+  }
+  if (offset < 2) {
+    pthread_mutex_lock(&dcache_lock);
+    parent = dir == ROOT_INO || dcache[dir].parent < 0 ? dir : dcache[dir].parent;
+    pthread_mutex_unlock(&dcache_lock);
+    inode_stat(parent, &st);
+    if (fn(arg, "..", &st, 2))
+      return;
+  }
+  dir_walk(dir, 0, offset, dir_list_fn, &la);
+}
+
+struct readdir_arg {
+  void *buf;
+  fuse_fill_dir_t filler;
+};
+
+static int readdir_fill(void *arg, const char *name, const struct stat *st, off_t next)
+{
+  struct readdir_arg *ra = arg;
+  return ra->filler(ra->buf, name, st, next);
+}
+
 int sfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
 {
   int retstat = 0;
-  char buff[512];
-  int i, j, h;
+  struct readdir_arg ra = { buf, filler };
 
   log_msg("\nsfs_readdir(path=\"%s\", buf=0x%08x, filler=0x%08x, offset=%lld, fi=0x%08x)\n", path, buf, filler, offset, fi);
-  memset(buff, 0, sizeof(char)*512);
-  filler( buf, ".\0",  NULL, 0 );
-  filler( buf, "..\0", NULL, 0 );
 
-  //iterating through the blocks
-  for(j = 24; j < 49; j++)
-  {
-    block_read(j, buff);
-    //iterating through direntry_array within block j (j between 24 - 48 inclusive)
-    direntry_array *pde = (direntry_array *)buff;
-    for(i = 0; i < 4; i++)
-    {
-      //log_msg("sfs_readdir LINE %d: direntry contents: name=%s, inode_num=%d\n",__LINE__, pde->d[i].name, pde->d[i].inode_num);
-      if( pde->d[i].name[0] == '\0' )
-      {
-        continue;
-      }
-      char *pChar = malloc(sizeof(char)*120);
-      memset(pChar, '\0', sizeof(char)*120);
-      strncpy(pChar, pde->d[i].name+1, 10);
-      filler(buf, pChar, NULL, 0);
-    }
-  }
+  //walking the directory tree from @offset, leaves in hash order, until
+  //the filler is full; an opened directory is found through its handle
+  int type = TYPE_DIR, dir;
+  pthread_rwlock_rdlock(&dir_lock);
+  if (SFS_FILE(fi))
+    dir = SFS_FILE(fi)->inode_num;
+  else
+    dir = path_walk(path, strlen(path), &type);
+  if (dir < 0)
+    retstat = dir;
+  else if (type != TYPE_DIR)
+    retstat = -ENOTDIR;
+  else
+    dir_list(dir, offset, readdir_fill, &ra);
+  pthread_rwlock_unlock(&dir_lock);
   return retstat;
 }
 
@@ -1001,34 +3096,218 @@ int sfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offse
 int sfs_releasedir(const char *path, struct fuse_file_info *fi)
 {
   int retstat = 0;
+  log_msg("\nsfs_releasedir(path=\"%s\", fi=0x%08x)\n", path, fi);
+
+  sfs_file_close(fi);
+  return retstat;
+}
+
+/* The same filesystem by inode number, for the low-level front end in
+ * sfs_ll.c.  Each call names a directory inode and one component in
+ * it, so nothing walks a path.  An inode looked up or made here holds
+ * a reference, like an open file, until sfs_iforget() drops it. */
+
+// check that @dir is a live directory and @name fits in it; the
+// caller holds dir_lock
+static int dir_check(int dir, const char *name)
+{
+  inode d;
+  if (dir < 0 || dir >= SFS_NUM_INODES)
+    return -ENOENT;
+  inode_get(dir, &d);
+  if (d.type == 0 || d.link_count == 0)
+    return -ENOENT;
+  if (d.type != TYPE_DIR)
+    return -ENOTDIR;
+  if (name && strlen(name) >= 120)
+    return -ENAMETOOLONG;
+  return 0;
+}
+
+int sfs_ilookup(int dir, const char *name, struct stat *statbuf)
+{
+  int type;
+  pthread_rwlock_rdlock(&dir_lock);
+  int num = dir_check(dir, name);
+  if (num == 0)
+    num = dir_child(dir, name, &type);
+  if (num == -1)
+    num = -ENOENT;
+  if (num >= 0) {
+    inode_ref(num, 1);
+    inode_stat(num, statbuf);
+  }
+  pthread_rwlock_unlock(&dir_lock);
+  return num;
+}
+
+void sfs_iforget(int num, unsigned long nlookup)
+{
+  if (num >= 0 && num < SFS_NUM_INODES)
+    inode_unref(num, nlookup);
+}
+
+int sfs_igetattr(int num, struct stat *statbuf)
+{
+  inode ino;
+  if (num < 0 || num >= SFS_NUM_INODES)
+    return -ENOENT;
+  pthread_rwlock_rdlock(&inode_locks[num]);
+  inode_get(num, &ino);
+  if (ino.type != 0)
+    inode_stat(num, statbuf);
+  pthread_rwlock_unlock(&inode_locks[num]);
+  return ino.type != 0 ? 0 : -ENOENT;
+}
+
+int sfs_imknod(int dir, const char *name, mode_t mode, struct stat *statbuf)
+{
+  int type;
+  pthread_rwlock_wrlock(&dir_lock);
+  int num = dir_check(dir, name);
+  if (num == 0 && dir_child(dir, name, &type) != -1)
+    num = -EEXIST;
+  else if (num == 0)
+    num = create_locked(dir, name, S_ISDIR(mode) ? TYPE_DIR : TYPE_FILE, (int) mode);
+  if (num >= 0) {
+    inode_ref(num, 1);
+    inode_stat(num, statbuf);
+  }
+  pthread_rwlock_unlock(&dir_lock);
+  return num;
+}
+
+int sfs_iremove(int dir, const char *name, int isdir)
+{
+  pthread_rwlock_wrlock(&dir_lock);
+  int retstat = dir_check(dir, name);
+  if (retstat == 0)
+    retstat = remove_locked(dir, name, isdir);
+  pthread_rwlock_unlock(&dir_lock);
+  return retstat;
+}
+
+int sfs_irename(int dir, const char *name, int newdir, const char *newname)
+{
+  int replaced;
+  pthread_rwlock_wrlock(&dir_lock);
+  int retstat = dir_check(dir, name);
+  if (retstat == 0)
+    retstat = dir_check(newdir, newname);
+  if (retstat == 0)
+    retstat = rename_locked(dir, name, newdir, newname, &replaced);
+  pthread_rwlock_unlock(&dir_lock);
+  return retstat;
+}
 
+int sfs_itruncate(int num, off_t size, struct fuse_file_info *fi, struct stat *statbuf)
+{
+  sfs_file *f = SFS_FILE(fi);
+  inode ino;
+  int retstat;
+  if (f)
+    num = f->inode_num;
+  if (num < 0 || num >= SFS_NUM_INODES)
+    return -ENOENT;
+  pthread_rwlock_wrlock(&inode_locks[num]);
+  inode_get(num, &ino);
+  retstat = ino.type != 0 ? inode_truncate(num, size) : -ENOENT;
+  if (retstat == 0)
+    inode_stat(num, statbuf);
+  pthread_rwlock_unlock(&inode_locks[num]);
+  return retstat;
+}
 
+int sfs_iopen(int num, struct fuse_file_info *fi, int isdir)
+{
+  inode ino;
+  int retstat;
+  if (num < 0 || num >= SFS_NUM_INODES)
+    return -ENOENT;
+  pthread_rwlock_rdlock(&dir_lock);
+  inode_get(num, &ino);
+  if (ino.type == 0)
+    retstat = -ENOENT;
+  else if (isdir && ino.type != TYPE_DIR)
+    retstat = -ENOTDIR;
+  else if (!isdir && ino.type == TYPE_DIR)
+    retstat = -EISDIR;
+  else
+    retstat = sfs_file_open(fi, num);
+  pthread_rwlock_unlock(&dir_lock);
   return retstat;
 }
 
+void sfs_irelease(struct fuse_file_info *fi)
+{
+  sfs_file_close(fi);
+}
+
+int sfs_ireaddir(struct fuse_file_info *fi, off_t offset, sfs_dirent_fn fn, void *arg)
+{
+  sfs_file *f = SFS_FILE(fi);
+  if (f == NULL)
+    return -EBADF;
+  pthread_rwlock_rdlock(&dir_lock);
+  dir_list(f->inode_num, offset, fn, arg);
+  pthread_rwlock_unlock(&dir_lock);
+  return 0;
+}
+
 struct fuse_operations sfs_oper = {
   .init = sfs_init,
   .destroy = sfs_destroy,
 
   .getattr = sfs_getattr,
+  .truncate = sfs_truncate,
+  .ftruncate = sfs_ftruncate,
   .create = sfs_create,
   .unlink = sfs_unlink,
+  .rename = sfs_rename,
   .open = sfs_open,
   .release = sfs_release,
   .read = sfs_read,
   .write = sfs_write,
+  .flush = sfs_flush,
+  .fsync = sfs_fsync,
 
   .rmdir = sfs_rmdir,
   .mkdir = sfs_mkdir,
 
   .opendir = sfs_opendir,
   .readdir = sfs_readdir,
-  .releasedir = sfs_releasedir
+  .releasedir = sfs_releasedir,
+
+  // I/O on open files goes through fi->fh, so fuse need not build paths
+  .flag_nullpath_ok = 1,
+  .flag_nopath = 1
+};
+
+// seconds the kernel keeps a negative lookup, -o negative_timeout=T
+#define SFS_NEGATIVE_TIMEOUT 1.0
+
+#define SFS_OPT(t, p, v) { t, offsetof(struct sfs_state, p), v }
+
+static struct fuse_opt sfs_opts[] = {
+  SFS_OPT("cache_kb=%lu", cache_kb, 0),
+  SFS_OPT("engine=%s", engine, 0),
+  SFS_OPT("mmap", use_mmap, 1),
+  SFS_OPT("negative_timeout=%lf", negative_timeout, 0),
+  SFS_OPT("lowlevel", lowlevel, 1),
+  FUSE_OPT_END
 };
 
 void sfs_usage()
 {
   fprintf(stderr, "usage:  sfs [FUSE and mount options] diskFile mountPoint\n");
+  fprintf(stderr, "diskFile must have been formatted with mkfs.sfs\n");
+  fprintf(stderr, "sfs options:\n");
+  fprintf(stderr, "    -o cache_kb=N    block cache size in KiB (default %d, 0 disables)\n", BLOCK_CACHE_DEFAULT / 1024);
+  fprintf(stderr, "    -o engine=E      block I/O engine: sync (default) or uring\n");
+  fprintf(stderr, "    -o mmap          access the disk file through a shared mapping\n");
+  fprintf(stderr, "    -o negative_timeout=T  seconds the kernel may cache a missing\n");
+  fprintf(stderr, "                     name (default %g, 0 disables)\n", SFS_NEGATIVE_TIMEOUT);
+  fprintf(stderr, "    -o lowlevel      serve the kernel through the inode-based fuse API\n");
   abort();
 }
 
@@ -1053,11 +3332,43 @@ int main(int argc, char *argv[])
   argv[argc-1] = NULL;
   argc--;
 
+  // pick our own -o options out before handing the rest to fuse
+  sfs_data->cache_kb = BLOCK_CACHE_DEFAULT / 1024;
+  sfs_data->engine = NULL;
+  sfs_data->use_mmap = 0;
+  sfs_data->negative_timeout = SFS_NEGATIVE_TIMEOUT;
+  sfs_data->lowlevel = 0;
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  if (fuse_opt_parse(&args, sfs_data, sfs_opts, NULL) == -1)
+    sfs_usage();
+  if (sfs_data->negative_timeout < 0)
+    sfs_usage();
+
+  // refuse a disk that is not formatted before fuse mounts anything
+  superblock sb;
+  if (sfs_super_read(sfs_data->diskfile, &sb) < 0)
+    return 1;
+
   sfs_data->logfile = log_open();
+  sfs_state = sfs_data;
+
+  if (sfs_data->lowlevel) {
+    fprintf(stderr, "about to call sfs_ll_main, %s \n", sfs_data->diskfile);
+    fuse_stat = sfs_ll_main(&args, sfs_data);
+    fuse_opt_free_args(&args);
+    fprintf(stderr, "sfs_ll_main returned %d\n", fuse_stat);
+    return fuse_stat;
+  }
+
+  // fuse's own default is not to cache misses at all; hand it ours
+  char neg_opt[64];
+  snprintf(neg_opt, sizeof(neg_opt), "-onegative_timeout=%g", sfs_data->negative_timeout);
+  fuse_opt_add_arg(&args, neg_opt);
 
   // turn over control to fuse
   fprintf(stderr, "about to call fuse_main, %s \n", sfs_data->diskfile);
-  fuse_stat = fuse_main(argc, argv, &sfs_oper, sfs_data);
+  fuse_stat = fuse_main(args.argc, args.argv, &sfs_oper, sfs_data);
+  fuse_opt_free_args(&args);
   fprintf(stderr, "fuse_main returned %d\n", fuse_stat);
 
   return fuse_stat;
@@ -0,0 +1,50 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _SFS_H_
+#define _SFS_H_
+
+#include <fuse.h>
+#include <sys/stat.h>
+
+// The filesystem as the front ends see it.  sfs.c drives the path
+// based fuse API itself; sfs_ll.c drives the low-level one through the
+// calls below, which take inode numbers instead of paths.  Calls that
+// return an int return 0, or an inode number, on success and -errno on
+// failure.
+
+void *sfs_init(struct fuse_conn_info *conn);
+void sfs_destroy(void *userdata);
+
+// I/O on a file opened with sfs_iopen(); @path may be NULL
+int sfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+int sfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+int sfs_flush(const char *path, struct fuse_file_info *fi);
+int sfs_fsync(const char *path, int datasync, struct fuse_file_info *fi);
+
+// lookup and mknod take a reference on the inode they return
+int sfs_ilookup(int dir, const char *name, struct stat *statbuf);
+void sfs_iforget(int num, unsigned long nlookup);
+int sfs_igetattr(int num, struct stat *statbuf);
+int sfs_imknod(int dir, const char *name, mode_t mode, struct stat *statbuf);
+int sfs_iremove(int dir, const char *name, int isdir);
+int sfs_irename(int dir, const char *name, int newdir, const char *newname);
+int sfs_itruncate(int num, off_t size, struct fuse_file_info *fi, struct stat *statbuf);
+
+// open files and directories hang their state off @fi->fh
+int sfs_iopen(int num, struct fuse_file_info *fi, int isdir);
+void sfs_irelease(struct fuse_file_info *fi);
+
+// readdir hands each entry its attributes, st_ino being the inode
+// number, and the offset to resume after it; nonzero stops the listing
+typedef int (*sfs_dirent_fn)(void *arg, const char *name, const struct stat *st, off_t next);
+int sfs_ireaddir(struct fuse_file_info *fi, off_t offset, sfs_dirent_fn fn, void *arg);
+
+// the low-level front end, run instead of fuse_main() with -o lowlevel
+int sfs_ll_main(struct fuse_args *args, struct sfs_state *sfs_data);
+
+#endif
@@ -0,0 +1,382 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  The low-level front end, mounted with -o lowlevel.  The kernel names
+  every file by a node ID, which here is simply the sfs inode number
+  plus one, so FUSE_ROOT_ID is the root directory and no request ever
+  builds or walks a path.  The kernel's lookup counts are held as
+  references on the inodes, so a node ID stays valid, and its number
+  unused, until the kernel forgets it.
+*/
+
+#include "params.h"
+
+#include <errno.h>
+#include <fuse_lowlevel.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "sfs.h"
+
+// seconds the kernel may keep names and attributes it was given
+#define SFS_LL_TIMEOUT 1.0
+
+// node IDs to inode numbers and back
+#define INO(n)  ((int)(n) - 1)
+#define NODE(i) ((fuse_ino_t)(i) + 1)
+
+static struct fuse_chan *sfs_ch;
+
+/* Drop the kernel's cached attributes of inode @num, after a change it
+ * could not see coming, such as a directory's size.  A write ends the
+ * file where the kernel expects it to, so it needs none.  The page
+ * cache is left alone, the request that made the change may still
+ * hold those pages locked. */
+static void sfs_ll_inval(int num)
+{
+  if (sfs_ch)
+    fuse_lowlevel_notify_inval_inode(sfs_ch, NODE(num), -1, 0);
+}
+
+// reply with the entry for inode @num, which holds one reference for it
+static void sfs_ll_entry(fuse_req_t req, int num, struct fuse_entry_param *e,
+                         struct fuse_file_info *fi)
+{
+  e->ino = NODE(num);
+  e->attr.st_ino = e->ino;
+  e->attr_timeout = SFS_LL_TIMEOUT;
+  e->entry_timeout = SFS_LL_TIMEOUT;
+  // an interrupted request never reaches the kernel's lookup count
+  if (fi == NULL) {
+    if (fuse_reply_entry(req, e) == -ENOENT)
+      sfs_iforget(num, 1);
+  } else if (fuse_reply_create(req, e, fi) == -ENOENT) {
+    sfs_irelease(fi);
+    sfs_iforget(num, 1);
+  }
+}
+
+static void sfs_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+  sfs_init(conn);
+}
+
+static void sfs_ll_destroy(void *userdata)
+{
+  sfs_destroy(userdata);
+}
+
+static void sfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  struct fuse_entry_param e;
+  memset(&e, 0, sizeof(e));
+  log_msg("\nsfs_ll_lookup(parent=%lu, name=\"%s\")\n", (unsigned long) parent, name);
+
+  int num = sfs_ilookup(INO(parent), name, &e.attr);
+  if (num == -ENOENT && SFS_DATA->negative_timeout > 0) {
+    // node ID 0 lets the kernel keep the miss
+    e.entry_timeout = SFS_DATA->negative_timeout;
+    fuse_reply_entry(req, &e);
+  } else if (num < 0) {
+    fuse_reply_err(req, -num);
+  } else {
+    sfs_ll_entry(req, num, &e, NULL);
+  }
+}
+
+static void sfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+  sfs_iforget(INO(ino), nlookup);
+  fuse_reply_none(req);
+}
+
+static void sfs_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+  size_t i;
+  for (i = 0; i < count; i++)
+    sfs_iforget(INO(forgets[i].ino), forgets[i].nlookup);
+  fuse_reply_none(req);
+}
+
+static void sfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  struct stat st;
+  int retstat = sfs_igetattr(INO(ino), &st);
+  if (retstat < 0) {
+    fuse_reply_err(req, -retstat);
+    return;
+  }
+  st.st_ino = ino;
+  fuse_reply_attr(req, &st, SFS_LL_TIMEOUT);
+}
+
+/* Only sizes are kept: a change of mode or owner is refused and
+ * times are ignored, as there is nowhere to put them. */
+static void sfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                           int to_set, struct fuse_file_info *fi)
+{
+  struct stat st;
+  int retstat;
+  log_msg("\nsfs_ll_setattr(ino=%lu, to_set=0x%x)\n", (unsigned long) ino, to_set);
+
+  if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))
+    retstat = -ENOSYS;
+  else if (to_set & FUSE_SET_ATTR_SIZE)
+    retstat = sfs_itruncate(INO(ino), attr->st_size, fi, &st);
+  else
+    retstat = sfs_igetattr(INO(ino), &st);
+  if (retstat < 0) {
+    fuse_reply_err(req, -retstat);
+    return;
+  }
+  st.st_ino = ino;
+  fuse_reply_attr(req, &st, SFS_LL_TIMEOUT);
+}
+
+static void sfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                          mode_t mode, struct fuse_file_info *fi)
+{
+  struct fuse_entry_param e;
+  memset(&e, 0, sizeof(e));
+  log_msg("\nsfs_ll_create(parent=%lu, name=\"%s\", mode=0%03o)\n", (unsigned long) parent, name, mode);
+
+  int num = sfs_imknod(INO(parent), name, S_IFREG | (mode & 07777), &e.attr);
+  if (num < 0) {
+    fuse_reply_err(req, -num);
+    return;
+  }
+  int retstat = sfs_iopen(num, fi, 0);
+  if (retstat < 0) {
+    sfs_iforget(num, 1);
+    fuse_reply_err(req, -retstat);
+    return;
+  }
+  sfs_ll_entry(req, num, &e, fi);
+  sfs_ll_inval(INO(parent));
+}
+
+static void sfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+  struct fuse_entry_param e;
+  memset(&e, 0, sizeof(e));
+  log_msg("\nsfs_ll_mkdir(parent=%lu, name=\"%s\", mode=0%03o)\n", (unsigned long) parent, name, mode);
+
+  int num = sfs_imknod(INO(parent), name, S_IFDIR | (mode & 07777), &e.attr);
+  if (num < 0) {
+    fuse_reply_err(req, -num);
+    return;
+  }
+  sfs_ll_entry(req, num, &e, NULL);
+  sfs_ll_inval(INO(parent));
+}
+
+static void sfs_ll_remove(fuse_req_t req, fuse_ino_t parent, const char *name, int isdir)
+{
+  log_msg("\nsfs_ll_remove(parent=%lu, name=\"%s\", isdir=%d)\n", (unsigned long) parent, name, isdir);
+
+  int retstat = sfs_iremove(INO(parent), name, isdir);
+  fuse_reply_err(req, -retstat);
+  if (retstat == 0)
+    sfs_ll_inval(INO(parent));
+}
+
+static void sfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  sfs_ll_remove(req, parent, name, 0);
+}
+
+static void sfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  sfs_ll_remove(req, parent, name, 1);
+}
+
+static void sfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                          fuse_ino_t newparent, const char *newname)
+{
+  log_msg("\nsfs_ll_rename(parent=%lu, name=\"%s\", newparent=%lu, newname=\"%s\")\n",
+          (unsigned long) parent, name, (unsigned long) newparent, newname);
+
+  int retstat = sfs_irename(INO(parent), name, INO(newparent), newname);
+  fuse_reply_err(req, -retstat);
+  if (retstat == 0) {
+    sfs_ll_inval(INO(parent));
+    if (newparent != parent)
+      sfs_ll_inval(INO(newparent));
+  }
+}
+
+static void sfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  int retstat = sfs_iopen(INO(ino), fi, 0);
+  if (retstat < 0)
+    fuse_reply_err(req, -retstat);
+  else if (fuse_reply_open(req, fi) == -ENOENT)
+    sfs_irelease(fi);
+}
+
+static void sfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                        struct fuse_file_info *fi)
+{
+  char *buf = malloc(size);
+  if (buf == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  int n = sfs_read(NULL, buf, size, off, fi);
+  if (n < 0)
+    fuse_reply_err(req, -n);
+  else
+    fuse_reply_buf(req, buf, n);
+  free(buf);
+}
+
+static void sfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+                         off_t off, struct fuse_file_info *fi)
+{
+  int n = sfs_write(NULL, buf, size, off, fi);
+  if (n < 0) {
+    fuse_reply_err(req, -n);
+    return;
+  }
+  fuse_reply_write(req, n);
+}
+
+static void sfs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  fuse_reply_err(req, -sfs_flush(NULL, fi));
+}
+
+static void sfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                         struct fuse_file_info *fi)
+{
+  fuse_reply_err(req, -sfs_fsync(NULL, datasync, fi));
+}
+
+static void sfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  sfs_irelease(fi);
+  fuse_reply_err(req, 0);
+}
+
+static void sfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  int retstat = sfs_iopen(INO(ino), fi, 1);
+  if (retstat < 0)
+    fuse_reply_err(req, -retstat);
+  else if (fuse_reply_open(req, fi) == -ENOENT)
+    sfs_irelease(fi);
+}
+
+// a readdir reply being filled in, as fuse_add_direntry() lays it out
+struct dirbuf {
+  fuse_req_t req;
+  char *p;
+  size_t size;
+  size_t used;
+};
+
+static int dirbuf_add(void *arg, const char *name, const struct stat *st, off_t next)
+{
+  struct dirbuf *b = arg;
+  struct stat s = *st;
+  s.st_ino = NODE(st->st_ino);
+
+  size_t len = fuse_add_direntry(b->req, b->p + b->used, b->size - b->used, name, &s, next);
+  if (len > b->size - b->used)
+    return 1;
+  b->used += len;
+  return 0;
+}
+
+static void sfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                           struct fuse_file_info *fi)
+{
+  struct dirbuf b = { req, malloc(size), size, 0 };
+  log_msg("\nsfs_ll_readdir(ino=%lu, size=%lu, off=%lld)\n", (unsigned long) ino, (unsigned long) size, (long long) off);
+
+  if (b.p == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  int retstat = sfs_ireaddir(fi, off, dirbuf_add, &b);
+  if (retstat < 0)
+    fuse_reply_err(req, -retstat);
+  else
+    fuse_reply_buf(req, b.p, b.used);
+  free(b.p);
+}
+
+static void sfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  sfs_irelease(fi);
+  fuse_reply_err(req, 0);
+}
+
+static struct fuse_lowlevel_ops sfs_ll_oper = {
+  .init = sfs_ll_init,
+  .destroy = sfs_ll_destroy,
+
+  .lookup = sfs_ll_lookup,
+  .forget = sfs_ll_forget,
+  .forget_multi = sfs_ll_forget_multi,
+  .getattr = sfs_ll_getattr,
+  .setattr = sfs_ll_setattr,
+  .create = sfs_ll_create,
+  .unlink = sfs_ll_unlink,
+  .rename = sfs_ll_rename,
+  .open = sfs_ll_open,
+  .release = sfs_ll_release,
+  .read = sfs_ll_read,
+  .write = sfs_ll_write,
+  .flush = sfs_ll_flush,
+  .fsync = sfs_ll_fsync,
+
+  .rmdir = sfs_ll_rmdir,
+  .mkdir = sfs_ll_mkdir,
+
+  .opendir = sfs_ll_opendir,
+  .readdir = sfs_ll_readdir,
+  .releasedir = sfs_ll_releasedir
+};
+
+/** Mount and serve the low-level API until unmounted
+ *
+ * Does what fuse_main() does for the path-based one, taking the same
+ * fuse options from @args.  Returns 0 on a clean unmount.
+ */
+int sfs_ll_main(struct fuse_args *args, struct sfs_state *sfs_data)
+{
+  struct fuse_chan *ch;
+  struct fuse_session *se;
+  char *mountpoint;
+  int multithreaded, foreground;
+  int err = -1;
+
+  if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1)
+    return 1;
+
+  if ((ch = fuse_mount(mountpoint, args)) != NULL) {
+    se = fuse_lowlevel_new(args, &sfs_ll_oper, sizeof(sfs_ll_oper), sfs_data);
+    if (se != NULL) {
+      if (fuse_set_signal_handlers(se) != -1) {
+        fuse_session_add_chan(se, ch);
+        sfs_ch = ch;
+        if (fuse_daemonize(foreground) != -1)
+          err = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+        sfs_ch = NULL;
+        fuse_remove_signal_handlers(se);
+        fuse_session_remove_chan(ch);
+      }
+      fuse_session_destroy(se);
+    }
+    fuse_unmount(mountpoint, ch);
+  }
+  free(mountpoint);
+
+  return err ? 1 : 0;
+}
@@ -0,0 +1,242 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+
+struct uring {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    unsigned inflight;
+};
+
+static void uring_unmap(struct uring *r)
+{
+    if (r->sqes && r->sqes != MAP_FAILED)
+	munmap(r->sqes, r->sqes_len);
+    if (r->cq_ptr && r->cq_ptr != MAP_FAILED)
+	munmap(r->cq_ptr, r->cq_len);
+    if (r->sq_ptr && r->sq_ptr != MAP_FAILED)
+	munmap(r->sq_ptr, r->sq_len);
+}
+
+/** Set up a ring with room for @entries submissions
+ *
+ * Returns NULL (with errno set) when the kernel does not support
+ * io_uring or it is disabled; callers fall back to synchronous I/O.
+ */
+struct uring *uring_open(unsigned entries)
+{
+    struct io_uring_params p;
+    struct uring *r = calloc(1, sizeof(*r));
+
+    if (!r)
+	return NULL;
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) {
+	free(r);
+	return NULL;
+    }
+    r->entries = p.sq_entries;
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ|PROT_WRITE,
+		     MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ|PROT_WRITE,
+		     MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ|PROT_WRITE,
+		   MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sq_ptr == MAP_FAILED || r->cq_ptr == MAP_FAILED ||
+	r->sqes == MAP_FAILED) {
+	int err = errno;
+	uring_unmap(r);
+	close(r->fd);
+	free(r);
+	errno = err;
+	return NULL;
+    }
+
+    r->sq_head = (unsigned *)((char *)r->sq_ptr + p.sq_off.head);
+    r->sq_tail = (unsigned *)((char *)r->sq_ptr + p.sq_off.tail);
+    r->sq_mask = (unsigned *)((char *)r->sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)((char *)r->sq_ptr + p.sq_off.array);
+    r->cq_head = (unsigned *)((char *)r->cq_ptr + p.cq_off.head);
+    r->cq_tail = (unsigned *)((char *)r->cq_ptr + p.cq_off.tail);
+    r->cq_mask = (unsigned *)((char *)r->cq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->cq_ptr + p.cq_off.cqes);
+
+    return r;
+}
+
+void uring_close(struct uring *r)
+{
+    if (!r)
+	return;
+    uring_unmap(r);
+    close(r->fd);
+    free(r);
+}
+
+/** Number of submissions that can be queued before uring_submit() */
+int uring_space(struct uring *r)
+{
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+    // completions are not drained into a separate buffer, so never
+    // have more requests in flight than the ring has entries
+    if (r->inflight >= r->entries)
+	return 0;
+    return r->entries - (*r->sq_tail - head);
+}
+
+/** Queue a readv or writev of @iov at byte offset @off
+ *
+ * The iovec array must stay valid until the completion is reaped.
+ * Returns 0, or -EBUSY when the submission queue is full.
+ */
+int uring_queue_rw(struct uring *r, int write, int fd, const struct iovec *iov,
+		   int iovcnt, off_t off, unsigned long long user_data)
+{
+    unsigned tail = *r->sq_tail;
+    unsigned idx;
+    struct io_uring_sqe *sqe;
+
+    if (uring_space(r) <= 0)
+	return -EBUSY;
+
+    idx = tail & *r->sq_mask;
+    sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->off = off;
+    sqe->addr = (unsigned long)iov;
+    sqe->len = iovcnt;
+    sqe->user_data = user_data;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->inflight++;
+
+    return 0;
+}
+
+/** Queue an fallocate of @len bytes at byte offset @off with @mode
+ *
+ * Returns 0, or -EBUSY when the submission queue is full.  Kernels
+ * without IORING_OP_FALLOCATE complete it with -EINVAL.
+ */
+int uring_queue_fallocate(struct uring *r, int fd, int mode, off_t off,
+			  off_t len, unsigned long long user_data)
+{
+    unsigned tail = *r->sq_tail;
+    unsigned idx;
+    struct io_uring_sqe *sqe;
+
+    if (uring_space(r) <= 0)
+	return -EBUSY;
+
+    idx = tail & *r->sq_mask;
+    sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_FALLOCATE;
+    sqe->fd = fd;
+    sqe->off = off;
+    sqe->addr = len;
+    sqe->len = mode;
+    sqe->user_data = user_data;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->inflight++;
+
+    return 0;
+}
+
+/** Submit everything queued and wait for at least @wait_nr completions */
+int uring_submit(struct uring *r, unsigned wait_nr)
+{
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    unsigned to_submit = *r->sq_tail - head;
+    int ret;
+
+    do {
+	ret = syscall(__NR_io_uring_enter, r->fd, to_submit, wait_nr,
+		      wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret < 0 ? -errno : ret;
+}
+
+/** Drop whatever is queued but was not taken by the kernel
+ *
+ * For when uring_submit() fails or takes only part of the queue, so
+ * the caller can do those requests some other way.  Returns how many
+ * were dropped.
+ */
+int uring_unqueue(struct uring *r)
+{
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    int n = *r->sq_tail - head;
+
+    __atomic_store_n(r->sq_tail, head, __ATOMIC_RELEASE);
+    r->inflight -= n;
+
+    return n;
+}
+
+/** Wait for at least @wait_nr completions without submitting anything
+ *
+ * Unlike the rest of this file it needs no lock against the thread
+ * queueing, so the block layer calls it with its ring lock dropped.
+ */
+int uring_wait(struct uring *r, unsigned wait_nr)
+{
+    int ret;
+
+    do {
+	ret = syscall(__NR_io_uring_enter, r->fd, 0, wait_nr,
+		      IORING_ENTER_GETEVENTS, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret < 0 ? -errno : ret;
+}
+
+/** Take one completion off the ring
+ *
+ * Returns 0 and fills @user_data/@res, or -EAGAIN if none is ready.
+ */
+int uring_reap(struct uring *r, unsigned long long *user_data, int *res)
+{
+    unsigned head = *r->cq_head;
+    struct io_uring_cqe *cqe;
+
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+	return -EAGAIN;
+    cqe = &r->cqes[head & *r->cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+    r->inflight--;
+
+    return 0;
+}
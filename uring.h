@@ -0,0 +1,31 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// A minimal io_uring wrapper over the raw system calls, just enough
+// for the block layer to submit batches of vectored I/O and discards.
+
+struct uring;
+
+struct uring *uring_open(unsigned entries);
+void uring_close(struct uring *r);
+int uring_space(struct uring *r);
+int uring_queue_rw(struct uring *r, int write, int fd, const struct iovec *iov,
+		   int iovcnt, off_t off, unsigned long long user_data);
+int uring_queue_fallocate(struct uring *r, int fd, int mode, off_t off,
+			  off_t len, unsigned long long user_data);
+int uring_submit(struct uring *r, unsigned wait_nr);
+int uring_unqueue(struct uring *r);
+int uring_wait(struct uring *r, unsigned wait_nr);
+int uring_reap(struct uring *r, unsigned long long *user_data, int *res);
+
+#endif